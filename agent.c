@@ -34,11 +34,16 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
 
-#include "pipe.h"
+#include "transport.h"
+#include "cache.h"
 #include "worldmodel.h"
 
-int   pipe_fd;
 FILE* in_stream;
 FILE* out_stream;
 
@@ -53,61 +58,263 @@ bool win = false;
 bool explore = false;
 bool deep = false;
 
+// The outcome of planning for one turn
+struct Decision {
+    bool win;
+    bool explore;
+    char path[MAX_PATH_LEN];
+    struct Plan plans[MAX_PLANS];
+};
+
+struct Decision decision;
+
+// Speculative planning
+// While the engine works out our last move, a planner thread plans the
+// next turn from the world model as it stands after that move. When the
+// new view arrives we keep the speculative plan unless the tiles it
+// revealed could have changed it.
+bool pipelined = false;
+bool speculating = false;
+bool have_speculation = false;
+pthread_t speculation_thread;
+struct Decision speculation;
+
+// Cross-game plan cache
+// Every action we take goes in history. While a plan from an earlier
+// game still fits we follow it, and when we win on our own we add the
+// game to the cache. Maps from earlier games fill in the tiles we
+// haven't seen, so once we stop following a plan we plan on them too.
+char* cache_path = NULL;
+struct PlanCache* plan_cache = NULL;
+bool replaying = false;
+bool won = false;
+int n_history = 0;
+char history[MAX_PATH_LEN];
+
+// Plan a turn from scratch, preferring a winning path, then exploring,
+// then the longest run of new tiles we can make.
+void decide( struct WorldModel* wm, struct Decision* d ) {
+    // Leave out the goals there's no way to meet from here, so the
+    // search doesn't look everywhere for them
+    struct ReachGoals reach;
+    wm_reach_goals(wm, &reach);
+
+    // If the points of interest we know of give us a way to win, we
+    // don't need to search the grid at all
+    if ( reach.win && wm_poi_win(wm, d->path) ) {
+        d->win = true;
+        d->explore = false;
+        return;
+    }
+
+    // Search for a winning path first
+    d->win = false;
+    d->explore = false;
+    if ( reach.win ) {
+        d->plans[0].goal = GOAL_WIN;
+        d->plans[0].new_req = 0;
+        if ( wm_plan(wm, d->plans, 1) == 0 ) {
+            d->win = true;
+            wm_plan_path(&d->plans[0], d->path);
+            return;
+        }
+    }
+
+    // Otherwise head for the tile that reveals the most per move to
+    // find a winning path
+    if ( reach.explore && wm_explore(wm, d->path) ) {
+        d->explore = true;
+        return;
+    }
+
+    // If there are no more tiles to reveal, search for the longest run
+    // of new tiles we can make in one go and take its first step
+    int n_plans = 0;
+    int depth;
+    for ( depth = 10 < reach.new_tiles ? 10 : reach.new_tiles; depth > 0; depth-- ) {
+        d->plans[n_plans].goal = GOAL_DEPTH;
+        d->plans[n_plans].new_req = depth;
+        n_plans++;
+    }
+
+    int best = n_plans > 0 ? wm_plan(wm, d->plans, n_plans) : -1;
+    if ( best >= 0 ) {
+        wm_plan_path(&d->plans[best], d->path);
+    } else {
+        d->path[0] = '\0';
+    }
+}
+
+void* speculate( void* arg ) {
+    (void)arg;
+    decide(wm, &speculation);
+    return NULL;
+}
+
+// Start planning the next turn in the background if we know we will
+// need a new plan once the next view arrives.
+void speculation_start() {
+    if ( !pipelined || replaying || win || (explore && path[path_index] != '\0') ) {
+        return;
+    }
+
+    if ( pthread_create(&speculation_thread, NULL, speculate, NULL) == 0 ) {
+        speculating = true;
+    }
+}
+
+// Wait for the background planner. This must be done before the world
+// model is touched again.
+void speculation_finish() {
+    if ( speculating ) {
+        pthread_join(speculation_thread, NULL);
+        speculating = false;
+        have_speculation = true;
+    }
+}
+
+// Keep the map and a plan for it once we've won. A history that filled
+// up can't be replayed, so leave it out. Looking for a shorter plan can
+// take a while, so a child process keeps the game while we exit, after
+// letting go of the connection and stdout so nothing waits on it.
+void cache_game() {
+    if ( won && cache_path != NULL && n_history < MAX_PATH_LEN ) {
+        pid_t pid = fork();
+        if ( pid == 0 ) {
+            int null_fd = open("/dev/null", O_WRONLY);
+            if ( fileno(out_stream) != fileno(in_stream) ) {
+                close(fileno(out_stream));
+            }
+            close(fileno(in_stream));
+            if ( null_fd >= 0 ) {
+                dup2(null_fd, STDOUT_FILENO);
+                close(null_fd);
+            }
+            cache_record(cache_path, wm, history, n_history);
+            _exit(0);
+        } else if ( pid < 0 ) {
+            cache_record(cache_path, wm, history, n_history);
+        }
+        cache_path = NULL;
+    }
+}
+
 char get_action( char view[5][5] ) {
 
     char action = '\0';
+    int revealed = 0;
 
     if ( wm == NULL ) {
         wm = wm_create(view);
     } else {
-        wm_update_view(wm, view);
+        revealed = wm_update_view(wm, view);
+    }
+
+    // Fill in what we haven't seen from earlier games. If this view showed
+    // we filled it in wrong, whatever we planned on it has to go.
+    if ( plan_cache != NULL && cache_fill_map(plan_cache, wm) ) {
+        win = false;
+        explore = false;
+        deep = false;
+        have_speculation = false;
+        path_index = 0;
+        path[0] = '\0';
+    }
+
+    // Follow a plan from an earlier game while it still fits the map
+    replaying = false;
+    if ( plan_cache != NULL ) {
+        action = cache_next_action(plan_cache, wm, history, n_history);
+        replaying = ( action != '\0' );
     }
 
-    
     // If we already have a path just continue on that path
-    if ( win || (deep && path_index <=2) ) {
+    if ( replaying ) {
+    } else if ( win || (deep && path_index <=2) ) {
+        action = path[path_index];
+        path_index++;
+    } else if ( explore && wm_explore_test_plan(wm, path + path_index) ) {
+        // Keep exploring while the plan still ends somewhere new
         action = path[path_index];
         path_index++;
     } else {
         path_index = 0;
         deep = false;
-        // Try to find a winning path
-        win = wm_walk(wm, path, GOAL_WIN, 0);
 
-        // If we found a winning path
-        if ( win ) {
+        // The speculative plan was made from the same world model
+        // unless this view revealed tiles. Winning paths only cross
+        // known tiles so they stay good, and exploring stays good
+        // while the plan still reveals something.
+        struct Decision* d = &decision;
+        if ( have_speculation &&
+             ( revealed == 0 || speculation.win ||
+               (speculation.explore && wm_explore_test_plan(wm, speculation.path)) ) ) {
+            d = &speculation;
+        } else {
+            decide(wm, d);
+        }
+        have_speculation = false;
+
+        strcpy(path, d->path);
+        win     = d->win;
+        explore = d->explore;
+
+        if ( win || explore ) {
             action = path[path_index];
             path_index++;
         } else {
-            // Otherwise try to reveal tiles to find a winning
-            // path
-            explore = wm_walk(wm, path, GOAL_EXPLORE, 0);
-
-            if ( explore ) {
-                action = path[0];
-            } else {
-                // If there are no more paths to reveal, we have to make a choice
-                // Choose a run of depth 3, else 2, else 1
-                int depth;
-                for ( depth = 10; depth > 0; depth-- ) {
-                    if ( wm_walk(wm, path, GOAL_DEPTH, depth) ) {
-                        break;
-                    }
-                }
-
-                action = path[0];
-            }
+            action = path[0];
         }
     }
         
+    // The last action of a winning path wins the game
+    if ( win && path[path_index] == '\0' ) {
+        won = true;
+    }
+
     // Take the specified actions
     if ( action != '\0' ) {
         wm_take_action(wm, action);
+        if ( n_history < MAX_PATH_LEN ) {
+            history[n_history++] = action;
+        }
     }
 
     return action;
 }
 
+// Oracle mode
+// Solve a map given in full and print the shortest winning plan, as a
+// yardstick for the moves and planning time the agent takes on it
+int solve_map( char* map_path, int n_threads ) {
+    struct timespec start, end;
+    long states;
+
+    FILE* map = fopen(map_path, "r");
+    if ( map == NULL ) {
+        perror(map_path);
+        return 1;
+    }
+    struct WorldModel* full_wm = wm_load_map(map);
+    fclose(map);
+    if ( full_wm == NULL ) {
+        return 1;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    int length = wm_solve(full_wm, path, n_threads, 0, &states);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    wm_destroy(full_wm);
+
+    double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    if ( length < 0 ) {
+        printf("no win, %ld states, %.3fs\n", states, seconds);
+        return 1;
+    }
+    printf("%d actions, %ld states, %.3fs\n%s\n", length, states, seconds, path);
+    return 0;
+}
+
 void print_view()
 {
   int i,j;
@@ -131,23 +338,59 @@ void print_view()
 int main( int argc, char *argv[] )
 {
   char action;
-  int sd;
   int ch;
   int i,j;
 
   struct WorldModel* wm = NULL;
 
-  if ( argc < 3 ) {
-    printf("Usage: %s -p port\n", argv[0] );
+  Transport transport = TRANSPORT_TCP;
+  char* addr = NULL;
+  char* oracle_map = NULL;
+  int n_threads = sysconf(_SC_NPROCESSORS_ONLN);
+
+  for( i=1; i < argc; i++ ) {
+    if( strcmp( argv[i], "-p" ) == 0 && i+1 < argc ) {
+      transport = TRANSPORT_TCP;
+      addr = argv[++i];
+    }
+    else if( strcmp( argv[i], "-u" ) == 0 && i+1 < argc ) {
+      transport = TRANSPORT_UNIX;
+      addr = argv[++i];
+    }
+    else if( strcmp( argv[i], "-m" ) == 0 && i+1 < argc ) {
+      transport = TRANSPORT_SHM;
+      addr = argv[++i];
+    }
+    else if( strcmp( argv[i], "-s" ) == 0 ) {
+      pipelined = true;
+    }
+    else if( strcmp( argv[i], "-o" ) == 0 && i+1 < argc ) {
+      oracle_map = argv[++i];
+    }
+    else if( strcmp( argv[i], "-t" ) == 0 && i+1 < argc ) {
+      n_threads = atoi( argv[++i] );
+    }
+    else if( strcmp( argv[i], "-c" ) == 0 && i+1 < argc ) {
+      cache_path = argv[++i];
+    }
+  }
+
+  if ( oracle_map != NULL ) {
+    return solve_map( oracle_map, n_threads );
+  }
+
+  if ( addr == NULL ) {
+    printf("Usage: %s ( -p port | -u socket_path | -m shm_name ) [-s] [-c cache_file]\n"
+           "       %s -o map_file [-t threads]\n", argv[0], argv[0] );
     exit(1);
   }
 
-    // open socket to Game Engine
-  sd = tcpopen("localhost", atoi( argv[2] ));
+  if ( cache_path != NULL ) {
+    plan_cache = cache_open( cache_path );
+  }
 
-  pipe_fd    = sd;
-  in_stream  = fdopen(sd,"r");
-  out_stream = fdopen(sd,"w");
+    // open connection to Game Engine
+  transport_open(transport, addr, &in_stream, &out_stream);
 
   while(1) {
       // scan 5-by-5 wintow around current location
@@ -156,6 +399,9 @@ int main( int argc, char *argv[] )
         if( !(( i == 2 )&&( j == 2 ))) {
           ch = getc( in_stream );
           if( ch == -1 ) {
+            // The game is over, so there's time to keep it now
+            speculation_finish();
+            cache_game();
             exit(1);
           }
           view[i][j] = ch;
@@ -163,10 +409,14 @@ int main( int argc, char *argv[] )
       }
     }
 
+    speculation_finish();
+
     //print_view(); // COMMENT THIS OUT BEFORE SUBMISSION
     action = get_action( view );
     putc( action, out_stream );
     fflush( out_stream );
+
+    speculation_start();
   }
 
   free(wm);
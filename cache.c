@@ -0,0 +1,352 @@
+/*********************************************
+ *  cache.c
+ *  Maps and plans kept from earlier games
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "cache.h"
+
+struct PlanCache {
+    char* base;
+    size_t size;
+
+    // Records made on games that started with our view, found on the
+    // first lookup of the game, and those whose plan we can still follow
+    bool matched;
+    int n_records;
+    struct CacheRecord** records;
+    int n_candidates;
+    struct CacheRecord** candidates;
+
+    // The record whose map fills in the tiles we haven't seen, or NULL
+    struct CacheRecord* filled;
+};
+
+static char* record_tiles(struct CacheRecord* record) {
+    return (char*)(record + 1);
+}
+
+static char* record_actions(struct CacheRecord* record) {
+    return record_tiles(record) + record->width * record->height;
+}
+
+// Hash of the tiles we see from home before our first move
+static unsigned long long cache_fingerprint(struct WorldModel* wm) {
+    unsigned long long hash = 0xcbf29ce484222325ULL;
+    int i, j;
+
+    for ( i = -VIEW_DIST; i <= VIEW_DIST; i++ ) {
+        for ( j = -VIEW_DIST; j <= VIEW_DIST; j++ ) {
+            hash ^= (unsigned char)wm_get_seen_tile(wm, pos_set(HOME_POS + j, HOME_POS + i));
+            hash *= 0x100000001b3ULL;
+        }
+    }
+    return hash;
+}
+
+static bool cache_header_ok(struct CacheHeader* header) {
+    return header->magic == CACHE_MAGIC && header->version == CACHE_VERSION &&
+           header->grid_size == GRID_SIZE;
+}
+
+// Whether a record lies within the size it claims and its map within the
+// grid. The file is shared and anyone can write it, so nothing in it is
+// trusted until checked.
+static bool record_ok(struct CacheRecord* record, size_t space) {
+    if ( record->size < (int)sizeof(struct CacheRecord) || (size_t)record->size > space ) {
+        return false;
+    }
+    if ( record->width <= 0 || record->height <= 0 ||
+         record->left < 0 || record->width > (GRID_SIZE) - record->left ||
+         record->top < 0 || record->height > (GRID_SIZE) - record->top ) {
+        return false;
+    }
+    if ( record->n_actions < 0 || record->n_actions >= MAX_PATH_LEN ) {
+        return false;
+    }
+    return sizeof(struct CacheRecord) + (size_t)record->width * record->height +
+           record->n_actions <= (size_t)record->size;
+}
+
+struct PlanCache* cache_open(char* path) {
+    struct PlanCache* cache = calloc(1, sizeof(struct PlanCache));
+    struct stat st;
+
+    if ( cache == NULL ) {
+        fprintf(stderr, "No memory for cache_open!\n");
+        return NULL;
+    }
+
+    int fd = open(path, O_RDONLY);
+    if ( fd < 0 ) {
+        if ( errno != ENOENT ) {
+            perror(path);
+        }
+        return cache;
+    }
+
+    // Writers hold an exclusive lock, so we never map half a record
+    flock(fd, LOCK_SH);
+    if ( fstat(fd, &st) == 0 && st.st_size >= (off_t)sizeof(struct CacheHeader) ) {
+        char* base = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        if ( base == MAP_FAILED ) {
+            perror(path);
+        } else {
+            struct CacheHeader* header = (struct CacheHeader*)base;
+            if ( !cache_header_ok(header) ) {
+                fprintf(stderr, "%s is not a plan cache for this build\n", path);
+                munmap(base, st.st_size);
+            } else {
+                cache->base = base;
+                cache->size = st.st_size;
+            }
+        }
+    }
+    flock(fd, LOCK_UN);
+    close(fd);
+
+    return cache;
+}
+
+void cache_close(struct PlanCache* cache) {
+    if ( cache == NULL ) {
+        return;
+    }
+
+    if ( cache->base != NULL ) {
+        munmap(cache->base, cache->size);
+    }
+    free(cache->records);
+    free(cache->candidates);
+    free(cache);
+}
+
+// Pick out the records made on games that started with our view
+static void cache_match(struct PlanCache* cache, struct WorldModel* wm) {
+    unsigned long long fingerprint = cache_fingerprint(wm);
+    size_t offset = sizeof(struct CacheHeader);
+    int cap = 0, i;
+
+    cache->matched = true;
+
+    while ( cache->base != NULL && offset + sizeof(struct CacheRecord) <= cache->size ) {
+        struct CacheRecord* record = (struct CacheRecord*)(cache->base + offset);
+        if ( !record_ok(record, cache->size - offset) ) {
+            fprintf(stderr, "Bad record in plan cache!\n");
+            break;
+        }
+        offset += record->size;
+
+        if ( record->fingerprint != fingerprint ) {
+            continue;
+        }
+        if ( cache->n_records == cap ) {
+            cap = cap == 0 ? 16 : 2 * cap;
+            struct CacheRecord** records = realloc(cache->records, sizeof(struct CacheRecord*) * cap);
+            if ( records == NULL ) {
+                fprintf(stderr, "No memory for cache_match!\n");
+                break;
+            }
+            cache->records = records;
+        }
+        cache->records[cache->n_records++] = record;
+    }
+
+    cache->candidates = malloc(sizeof(struct CacheRecord*) * (cache->n_records + 1));
+    if ( cache->candidates == NULL ) {
+        fprintf(stderr, "No memory for cache_match!\n");
+        return;
+    }
+    for ( i = 0; i < cache->n_records; i++ ) {
+        cache->candidates[i] = cache->records[i];
+    }
+    cache->n_candidates = cache->n_records;
+}
+
+// Whether the record's map agrees with every tile we've seen. Tiles the
+// record's game never saw could be anything.
+static bool cache_fits(struct CacheRecord* record, struct WorldModel* wm) {
+    char* tiles = record_tiles(record);
+    int x, y;
+
+    for ( y = 0; y < record->height; y++ ) {
+        for ( x = 0; x < record->width; x++ ) {
+            char tile = tiles[y * record->width + x];
+            char seen = wm_get_seen_tile(wm, pos_set(record->left + x, record->top + y));
+            if ( tile != TILE_UNKNOWN && seen != TILE_UNKNOWN && tile != seen ) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+char cache_next_action(struct PlanCache* cache, struct WorldModel* wm, char* history, int n_history) {
+    struct CacheRecord* best = NULL;
+    int i, n = 0;
+
+    if ( !cache->matched ) {
+        cache_match(cache, wm);
+    }
+
+    // Drop the records that no longer fit, for good
+    for ( i = 0; i < cache->n_candidates; i++ ) {
+        struct CacheRecord* record = cache->candidates[i];
+        if ( record->n_actions <= n_history ||
+             memcmp(record_actions(record), history, n_history) != 0 ||
+             !cache_fits(record, wm) ) {
+            continue;
+        }
+        cache->candidates[n++] = record;
+        if ( best == NULL || record->n_actions < best->n_actions ) {
+            best = record;
+        }
+    }
+    cache->n_candidates = n;
+
+    if ( best == NULL ) {
+        return '\0';
+    }
+    return record_actions(best)[n_history];
+}
+
+bool cache_fill_map(struct PlanCache* cache, struct WorldModel* wm) {
+    struct CacheRecord* best = NULL;
+    int i;
+
+    if ( !cache->matched ) {
+        cache_match(cache, wm);
+    }
+
+    if ( cache->filled != NULL && cache_fits(cache->filled, wm) ) {
+        return false;
+    }
+
+    // What we filled in was wrong, so take it all back before trying the
+    // next record
+    bool wrong = ( cache->filled != NULL );
+    if ( wrong ) {
+        wm_forget_assumed(wm);
+        cache->filled = NULL;
+    }
+
+    // Of the maps that fit, the one that covers the most
+    for ( i = 0; i < cache->n_records; i++ ) {
+        struct CacheRecord* record = cache->records[i];
+        if ( ( best == NULL || record->width * record->height > best->width * best->height ) &&
+             cache_fits(record, wm) ) {
+            best = record;
+        }
+    }
+
+    if ( best != NULL ) {
+        wm_assume_tiles(wm, best->left, best->top, best->width, best->height, record_tiles(best));
+        cache->filled = best;
+    }
+    return wrong;
+}
+
+bool cache_record(char* path, struct WorldModel* wm, char* history, int n_history) {
+    int left = GRID_SIZE, top = GRID_SIZE, right = -1, bottom = -1;
+    long states;
+    int x, y;
+
+    // Solve the map as we saw it, in case we took the long way round
+    char* actions = malloc(MAX_PATH_LEN);
+    struct WorldModel* seen_wm = wm_seen_copy(wm);
+    if ( actions == NULL || seen_wm == NULL ) {
+        fprintf(stderr, "No memory for cache_record!\n");
+        free(actions);
+        wm_destroy(seen_wm);
+        return false;
+    }
+    int n_actions = wm_solve(seen_wm, actions, sysconf(_SC_NPROCESSORS_ONLN), CACHE_SOLVE_STATES, &states);
+    wm_destroy(seen_wm);
+    if ( n_actions < 0 || n_actions > n_history ) {
+        memcpy(actions, history, n_history);
+        n_actions = n_history;
+    }
+
+    for ( y = 0; y < GRID_SIZE; y++ ) {
+        for ( x = 0; x < GRID_SIZE; x++ ) {
+            if ( wm_get_seen_tile(wm, pos_set(x, y)) != TILE_UNKNOWN ) {
+                if ( x < left )   left = x;
+                if ( x > right )  right = x;
+                if ( y < top )    top = y;
+                if ( y > bottom ) bottom = y;
+            }
+        }
+    }
+
+    int width  = right - left + 1;
+    int height = bottom - top + 1;
+    int size = sizeof(struct CacheRecord) + width * height + n_actions;
+    size = (size + 7) & ~7;
+
+    struct CacheRecord* record = calloc(1, size);
+    if ( record == NULL ) {
+        fprintf(stderr, "No memory for cache_record!\n");
+        free(actions);
+        return false;
+    }
+    record->fingerprint = cache_fingerprint(wm);
+    record->size      = size;
+    record->left      = left;
+    record->top       = top;
+    record->width     = width;
+    record->height    = height;
+    record->n_actions = n_actions;
+    for ( y = 0; y < height; y++ ) {
+        for ( x = 0; x < width; x++ ) {
+            record_tiles(record)[y * width + x] = wm_get_seen_tile(wm, pos_set(left + x, top + y));
+        }
+    }
+    memcpy(record_actions(record), actions, n_actions);
+    free(actions);
+
+    int fd = open(path, O_RDWR | O_CREAT | O_APPEND, 0644);
+    if ( fd < 0 ) {
+        perror(path);
+        free(record);
+        return false;
+    }
+
+    // One write per record under the lock, so readers and other writers
+    // only ever see whole records
+    bool ok = true;
+    struct stat st;
+    struct CacheHeader header = { CACHE_MAGIC, CACHE_VERSION, GRID_SIZE, 0 };
+    flock(fd, LOCK_EX);
+    if ( fstat(fd, &st) == 0 && st.st_size == 0 ) {
+        ok = write(fd, &header, sizeof(header)) == sizeof(header);
+        if ( ok ) {
+            ok = write(fd, record, size) == size;
+        }
+        if ( !ok ) {
+            perror(path);
+        }
+    } else if ( pread(fd, &header, sizeof(header), 0) != sizeof(header) || !cache_header_ok(&header) ) {
+        // Don't add to a file that another build or program wrote
+        fprintf(stderr, "%s is not a plan cache for this build\n", path);
+        ok = false;
+    } else {
+        ok = write(fd, record, size) == size;
+        if ( !ok ) {
+            perror(path);
+        }
+    }
+    flock(fd, LOCK_UN);
+    close(fd);
+
+    free(record);
+    return ok;
+}
@@ -0,0 +1,70 @@
+/*********************************************
+ *  cache.h
+ *  Maps and plans kept from earlier games
+*/
+
+#ifndef CACHE_H
+#define CACHE_H
+
+#include <stdbool.h>
+
+#include "worldmodel.h"
+
+// Cross-game plan cache
+// We play the same maps over and over, so when we win a game we append
+// the map as we first saw it and a winning plan for it to a cache file.
+// Later games that start with the same view around home follow the plan
+// for as long as every tile they see matches the map it was made on,
+// skipping the exploring and planning. The map also fills in the tiles a
+// game hasn't seen yet, for its own planning to use once it stops
+// following the plan. Records are only ever appended,
+// under a file lock, so any number of agents can share one file. Each
+// agent maps the records that were there when it started read only.
+// Records hold grid positions, so a file is only any use to builds with
+// the same GRID_SIZE, which the header records.
+#define CACHE_MAGIC   0x6e616c70
+#define CACHE_VERSION 2
+
+struct CacheHeader {
+    unsigned int magic;
+    unsigned int version;
+    unsigned int grid_size;
+    unsigned int pad;
+};
+
+// Followed by width*height tiles of the map, row by row, then the plan.
+// size covers all of it, rounded up to keep records aligned.
+struct CacheRecord {
+    unsigned long long fingerprint;   // hash of the first view from home
+    int size;
+    int left;                         // where the map sits on the grid
+    int top;
+    int width;
+    int height;
+    int n_actions;
+};
+
+struct PlanCache;
+
+// An empty cache if the file doesn't exist yet
+struct PlanCache* cache_open(char* path);
+void cache_close(struct PlanCache* cache);
+
+// The next action of the shortest cached plan that starts with history
+// and whose map agrees with every tile we've seen, or '\0' if none do
+char cache_next_action(struct PlanCache* cache, struct WorldModel* wm, char* history, int n_history);
+
+// Fill in the tiles we haven't seen from the biggest cached map that
+// agrees with every tile we have. Called after each view, it takes them
+// back as soon as a tile we see shows them wrong, and fills them in again
+// from the next map that fits. Returns true when it took tiles back, so
+// anything planned on them has to go.
+bool cache_fill_map(struct PlanCache* cache, struct WorldModel* wm);
+
+// Append the map we've seen and the shortest plan we can find for it,
+// which is the game we just won if nothing shorter turns up. The search
+// for a shorter plan gives up after CACHE_SOLVE_STATES states.
+#define CACHE_SOLVE_STATES 2000000
+bool cache_record(char* path, struct WorldModel* wm, char* history, int n_history);
+
+#endif
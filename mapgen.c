@@ -0,0 +1,356 @@
+/*********************************************
+ *  mapgen.c
+ *  Procedural map generator for benchmarking the agent
+*/
+
+/*
+ * Writes solvable maps in the engine's text map format, with the agent's
+ * start marked '^'. The same seed and parameters always give the same map.
+ *
+ * Maps are solvable by construction. We carve a route from the start to
+ * the treasure, then put the doors, trees and water gaps asked for on
+ * that route, with the key, axe and one stone per water gap placed on the
+ * route before them. Walking the route there and back again wins, since
+ * doors stay unlocked, trees stay chopped and stones stay in the water.
+ * Everything off the route is random walls, water and trees.
+ *
+ * Maps are at most HOME_POS+1 tiles a side, so wherever the agent starts
+ * the whole map fits in its world model.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <sys/stat.h>
+
+#include "worldmodel.h"
+
+#define MAX_MAP_SIZE (HOME_POS + 1)
+#define MIN_MAP_SIZE 8
+
+// Size of the random blobs of walls, water and trees
+#define BLOB_SIZE 8
+
+struct MapParams {
+    int width;
+    int height;
+    int wall;      // percentage of tiles
+    int water;     // percentage of tiles
+    int trees;     // percentage of tiles
+    int doors;     // on the route
+    int gaps;      // water gaps on the route, each needing a stone
+    unsigned long long seed;
+};
+
+char map[MAX_MAP_SIZE][MAX_MAP_SIZE];
+
+// xorshift64*, so maps don't depend on the C library's rand()
+unsigned long long rng_state;
+
+unsigned int rng_next() {
+    rng_state ^= rng_state >> 12;
+    rng_state ^= rng_state << 25;
+    rng_state ^= rng_state >> 27;
+    return (unsigned int)((rng_state * 0x2545f4914f6cdd1dULL) >> 32);
+}
+
+int rng_range( int n ) {
+    return rng_next() % n;
+}
+
+bool in_interior( struct MapParams* p, int x, int y ) {
+    return x > 0 && x < p->width - 1 && y > 0 && y < p->height - 1;
+}
+
+// Scatter blobs of tile until roughly percent of the interior is covered
+void scatter( struct MapParams* p, char tile, int percent ) {
+    int area = (p->width - 2) * (p->height - 2);
+    int blobs = area * percent / (100 * BLOB_SIZE);
+    int i, j;
+
+    for ( i = 0; i < blobs; i++ ) {
+        int x = 1 + rng_range(p->width - 2);
+        int y = 1 + rng_range(p->height - 2);
+        for ( j = 0; j < BLOB_SIZE; j++ ) {
+            map[y][x] = tile;
+            switch ( rng_range(4) ) {
+                case 0: if ( in_interior(p, x+1, y) ) x++; break;
+                case 1: if ( in_interior(p, x-1, y) ) x--; break;
+                case 2: if ( in_interior(p, x, y+1) ) y++; break;
+                case 3: if ( in_interior(p, x, y-1) ) y--; break;
+            }
+        }
+    }
+}
+
+// Loop erased random walk from (sx,sy) to (tx,ty), biased towards the
+// target. Returns the number of tiles on the route, including both ends.
+int carve_route( struct MapParams* p, int sx, int sy, int tx, int ty, int* route_x, int* route_y ) {
+    static int index[MAX_MAP_SIZE][MAX_MAP_SIZE];
+    int len = 0;
+    int x = sx, y = sy;
+    int i, j;
+
+    for ( i = 0; i < MAX_MAP_SIZE; i++ ) {
+        for ( j = 0; j < MAX_MAP_SIZE; j++ ) {
+            index[i][j] = -1;
+        }
+    }
+
+    while ( true ) {
+        // If we come back to a tile, erase the loop we just made
+        if ( index[y][x] >= 0 ) {
+            for ( i = index[y][x] + 1; i < len; i++ ) {
+                index[route_y[i]][route_x[i]] = -1;
+            }
+            len = index[y][x] + 1;
+        } else {
+            index[y][x] = len;
+            route_x[len] = x;
+            route_y[len] = y;
+            len++;
+        }
+
+        if ( x == tx && y == ty ) {
+            break;
+        }
+
+        int nx = x, ny = y;
+        if ( rng_range(10) < 6 ) {
+            if ( x != tx && (y == ty || rng_range(2)) ) {
+                nx += ( tx > x ) ? 1 : -1;
+            } else {
+                ny += ( ty > y ) ? 1 : -1;
+            }
+        } else {
+            switch ( rng_range(4) ) {
+                case 0: nx++; break;
+                case 1: nx--; break;
+                case 2: ny++; break;
+                case 3: ny--; break;
+            }
+        }
+
+        if ( in_interior(p, nx, ny) ) {
+            x = nx;
+            y = ny;
+        }
+    }
+
+    return len;
+}
+
+// Put n copies of tile on distinct free route tiles in [lo, hi), marking
+// them used. Returns the lowest index used, or hi if none were placed.
+int place_on_route( int* route_x, int* route_y, bool* used, int lo, int hi, int n, char tile ) {
+    int first = hi;
+    int tries = 0;
+
+    while ( n > 0 && hi > lo && tries < 100 * (hi - lo) ) {
+        int i = lo + rng_range(hi - lo);
+        tries++;
+        if ( used[i] ) {
+            continue;
+        }
+        used[i] = true;
+        map[route_y[i]][route_x[i]] = tile;
+        if ( i < first ) {
+            first = i;
+        }
+        n--;
+    }
+
+    return first;
+}
+
+bool generate( struct MapParams* p ) {
+    static int route_x[MAX_MAP_SIZE * MAX_MAP_SIZE];
+    static int route_y[MAX_MAP_SIZE * MAX_MAP_SIZE];
+    static bool used[MAX_MAP_SIZE * MAX_MAP_SIZE];
+    int x, y, i;
+
+    rng_state = p->seed * 0x9e3779b97f4a7c15ULL + 1;
+
+    // Walls around the edge, land inside, then the random obstacles
+    for ( y = 0; y < p->height; y++ ) {
+        for ( x = 0; x < p->width; x++ ) {
+            map[y][x] = in_interior(p, x, y) ? TILE_LAND : TILE_WALL;
+        }
+    }
+    scatter(p, TILE_WALL, p->wall);
+    scatter(p, TILE_WATER, p->water);
+    scatter(p, TILE_TREE, p->trees);
+
+    // Start and treasure at least half the map apart
+    int sx, sy, tx, ty;
+    do {
+        sx = 1 + rng_range(p->width - 2);
+        sy = 1 + rng_range(p->height - 2);
+        tx = 1 + rng_range(p->width - 2);
+        ty = 1 + rng_range(p->height - 2);
+    } while ( abs(sx - tx) + abs(sy - ty) < (p->width + p->height - 4) / 2 );
+
+    int len = carve_route(p, sx, sy, tx, ty, route_x, route_y);
+    for ( i = 0; i < len; i++ ) {
+        map[route_y[i]][route_x[i]] = TILE_LAND;
+        used[i] = false;
+    }
+    used[0] = used[len-1] = true;
+
+    // Need room for every obstacle and the item it needs before it
+    int needed = p->doors + (p->doors > 0) + 2 * (p->trees > 0) + 2 * p->gaps;
+    if ( needed > len - 2 ) {
+        return false;
+    }
+
+    // Obstacles go in the back two thirds of the route, and the items
+    // they need in front of the first of them
+    int split = len / 3;
+    int first_door = place_on_route(route_x, route_y, used, split, len - 1, p->doors, TILE_DOOR);
+    if ( p->doors > 0 ) {
+        place_on_route(route_x, route_y, used, 1, first_door, 1, TILE_KEY);
+    }
+
+    int first_tree = len - 1;
+    if ( p->trees > 0 ) {
+        first_tree = place_on_route(route_x, route_y, used, split, len - 1, 1, TILE_TREE);
+        place_on_route(route_x, route_y, used, 1, first_tree, 1, TILE_AXE);
+    }
+
+    // One stone in front of every water gap
+    for ( i = 0; i < p->gaps; i++ ) {
+        int gap = place_on_route(route_x, route_y, used, split, len - 1, 1, TILE_WATER);
+        if ( place_on_route(route_x, route_y, used, 1, gap, 1, TILE_STONE) == gap ) {
+            return false;
+        }
+    }
+
+    map[sy][sx] = '^';
+    map[ty][tx] = TILE_TREASURE;
+
+    return true;
+}
+
+bool write_map( struct MapParams* p, FILE* out ) {
+    int x, y;
+
+    // Some parameters can't fit on a given route, so try further seeds
+    unsigned long long seed = p->seed;
+    while ( !generate(p) ) {
+        p->seed++;
+        if ( p->seed - seed > 1000 ) {
+            fprintf(stderr, "Can't fit %d doors and %d gaps on a %dx%d map\n",
+                    p->doors, p->gaps, p->width, p->height);
+            p->seed = seed;
+            return false;
+        }
+    }
+    p->seed = seed;
+
+    for ( y = 0; y < p->height; y++ ) {
+        for ( x = 0; x < p->width; x++ ) {
+            putc(map[y][x], out);
+        }
+        putc('\n', out);
+    }
+
+    return true;
+}
+
+// Write a sweep of maps over size and obstacle mix into dir, and an index
+// of them in CSV on stdout
+void sweep( struct MapParams* base, char* dir, int seeds ) {
+    int sizes[]  = { 10, 20, 40, 60, MAX_MAP_SIZE };
+    int waters[] = { 0, 10, 20, 30 };
+    int trees[]  = { 0, 5, 10 };
+    int doors[]  = { 0, 2 };
+    int gaps[]   = { 0, 2 };
+    int a, b, c, d, e, s;
+    char path[4096];
+
+    mkdir(dir, 0755);
+
+    printf("file,width,height,wall,water,trees,doors,gaps,seed\n");
+
+    for ( a = 0; a < (int)(sizeof(sizes) / sizeof(int)); a++ ) {
+    for ( b = 0; b < (int)(sizeof(waters) / sizeof(int)); b++ ) {
+    for ( c = 0; c < (int)(sizeof(trees) / sizeof(int)); c++ ) {
+    for ( d = 0; d < (int)(sizeof(doors) / sizeof(int)); d++ ) {
+    for ( e = 0; e < (int)(sizeof(gaps) / sizeof(int)); e++ ) {
+    for ( s = 0; s < seeds; s++ ) {
+        struct MapParams p = *base;
+        p.width  = sizes[a];
+        p.height = sizes[a];
+        p.water  = waters[b];
+        p.trees  = trees[c];
+        p.doors  = doors[d];
+        p.gaps   = gaps[e];
+        p.seed   = base->seed + s;
+
+        snprintf(path, sizeof(path), "%s/map_%dx%d_x%d_w%d_t%d_d%d_g%d_s%llu.txt", dir,
+                 p.width, p.height, p.wall, p.water, p.trees, p.doors, p.gaps, p.seed);
+
+        FILE* out = fopen(path, "w");
+        if ( out == NULL ) {
+            perror(path);
+            exit(1);
+        }
+        bool ok = write_map(&p, out);
+        fclose(out);
+
+        if ( ok ) {
+            printf("%s,%d,%d,%d,%d,%d,%d,%d,%llu\n", path,
+                   p.width, p.height, p.wall, p.water, p.trees, p.doors, p.gaps, p.seed);
+        } else {
+            remove(path);
+        }
+    }}}}}}
+}
+
+void usage( char* name ) {
+    printf("Usage: %s [-w width] [-h height] [-x wall%%] [-W water%%] [-t tree%%]\n"
+           "          [-d doors] [-g water_gaps] [-s seed] [-S dir [-n seeds]]\n"
+           "Sizes are %d to %d. With -S, writes a sweep of maps into dir and\n"
+           "an index of them on stdout, otherwise writes one map to stdout.\n",
+           name, MIN_MAP_SIZE, MAX_MAP_SIZE);
+    exit(1);
+}
+
+int main( int argc, char *argv[] )
+{
+    struct MapParams p = { 30, 30, 10, 10, 5, 1, 1, 1 };
+    char* sweep_dir = NULL;
+    int seeds = 3;
+    int i;
+
+    for ( i = 1; i < argc; i++ ) {
+        if ( i + 1 >= argc ) {
+            usage(argv[0]);
+        }
+        if      ( strcmp(argv[i], "-w") == 0 ) p.width  = atoi(argv[++i]);
+        else if ( strcmp(argv[i], "-h") == 0 ) p.height = atoi(argv[++i]);
+        else if ( strcmp(argv[i], "-x") == 0 ) p.wall   = atoi(argv[++i]);
+        else if ( strcmp(argv[i], "-W") == 0 ) p.water  = atoi(argv[++i]);
+        else if ( strcmp(argv[i], "-t") == 0 ) p.trees  = atoi(argv[++i]);
+        else if ( strcmp(argv[i], "-d") == 0 ) p.doors  = atoi(argv[++i]);
+        else if ( strcmp(argv[i], "-g") == 0 ) p.gaps   = atoi(argv[++i]);
+        else if ( strcmp(argv[i], "-s") == 0 ) p.seed   = strtoull(argv[++i], NULL, 10);
+        else if ( strcmp(argv[i], "-S") == 0 ) sweep_dir = argv[++i];
+        else if ( strcmp(argv[i], "-n") == 0 ) seeds    = atoi(argv[++i]);
+        else usage(argv[0]);
+    }
+
+    if ( p.width < MIN_MAP_SIZE || p.width > MAX_MAP_SIZE ||
+         p.height < MIN_MAP_SIZE || p.height > MAX_MAP_SIZE ) {
+        usage(argv[0]);
+    }
+
+    if ( sweep_dir != NULL ) {
+        sweep(&p, sweep_dir, seeds);
+    } else if ( !write_map(&p, stdout) ) {
+        exit(1);
+    }
+
+    return 0;
+}
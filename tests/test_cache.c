@@ -0,0 +1,363 @@
+/*********************************************
+ *  test_cache.c
+ *  The plan cache must hand back a plan and a map only to games that
+ *  fit them, take back a map as soon as a game shows it wrong, skip
+ *  records it can't trust, and keep every record whole when several
+ *  agents add to it at once. Plays small maps through a world model as
+ *  the agent would and checks what the cache makes of them.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include "cache.h"
+#include "worldmodel.h"
+
+#define N_WRITERS 4
+
+// The key for the door in front of the treasure
+static const char* map_a =
+    "**************\n"
+    "*            *\n"
+    "* ^   ****   *\n"
+    "*     *$ -   *\n"
+    "*  k  ****   *\n"
+    "**************\n";
+
+// The same map, but with a wall in the far corner
+static const char* map_far_wall =
+    "**************\n"
+    "*           **\n"
+    "* ^   ****   *\n"
+    "*     *$ -   *\n"
+    "*  k  ****   *\n"
+    "**************\n";
+
+// A different view from home
+static const char* map_b =
+    "**************\n"
+    "*            *\n"
+    "* ^   ****   *\n"
+    "*     *$ -   *\n"
+    "*   k ****   *\n"
+    "**************\n";
+
+// The far corner of the maps, on the grid, which the first view doesn't show
+static const struct Pos far_corner = { HOME_POS + 10, HOME_POS - 1 };
+
+static int failures = 0;
+
+static void check(bool ok, const char* what) {
+    if ( !ok ) {
+        fprintf(stderr, "test_cache: %s\n", what);
+        failures++;
+    }
+}
+
+static struct WorldModel* load(const char* map) {
+    FILE* in = fmemopen((void*)map, strlen(map), "r");
+    struct WorldModel* wm = wm_load_map(in);
+    fclose(in);
+    if ( wm == NULL ) {
+        exit(1);
+    }
+    return wm;
+}
+
+// A game on a map, with the world model the agent would keep and where
+// it is on the map, which the world model keeps to itself
+struct Game {
+    struct WorldModel* truth;
+    struct WorldModel* wm;
+    struct Pos pos;
+    Direction dir;
+    char history[MAX_PATH_LEN];
+    int n_history;
+};
+
+// What the engine shows from where the game stands
+static void game_view(struct Game* game, char view[VIEW_SIZE][VIEW_SIZE]) {
+    int i, j;
+
+    for ( i = -VIEW_DIST; i <= VIEW_DIST; i++ ) {
+        for ( j = -VIEW_DIST; j <= VIEW_DIST; j++ ) {
+            struct Pos pos = pos_forward_rel(game->pos, -i, game->dir);
+            pos = pos_forward_rel(pos, j, dir_turn_right(game->dir));
+            view[i + VIEW_DIST][j + VIEW_DIST] = wm_get_tile(game->truth, pos);
+        }
+    }
+}
+
+static void game_start(struct Game* game, const char* map) {
+    char view[VIEW_SIZE][VIEW_SIZE];
+
+    game->truth = load(map);
+    game->pos = pos_set(HOME_POS, HOME_POS);
+    game->dir = DIRECTION_UP;
+    game->n_history = 0;
+    game_view(game, view);
+    game->wm = wm_create(view);
+    if ( game->wm == NULL ) {
+        exit(1);
+    }
+}
+
+static void game_act(struct Game* game, char action) {
+    char view[VIEW_SIZE][VIEW_SIZE];
+
+    switch ( action ) {
+        case ACTION_FORWARD: game->pos = pos_forward_rel(game->pos, 1, game->dir); break;
+        case ACTION_LEFT:    game->dir = dir_turn_left(game->dir);                 break;
+        case ACTION_RIGHT:   game->dir = dir_turn_right(game->dir);                break;
+    }
+    wm_take_action(game->truth, action);
+    wm_take_action(game->wm, action);
+    game->history[game->n_history++] = action;
+
+    game_view(game, view);
+    wm_update_view(game->wm, view);
+}
+
+static void game_end(struct Game* game) {
+    wm_destroy(game->truth);
+    wm_destroy(game->wm);
+}
+
+static long file_size(const char* path) {
+    struct stat st;
+    return stat(path, &st) == 0 ? (long)st.st_size : -1;
+}
+
+static void write_file(const char* path, const char* data, long size) {
+    FILE* out = fopen(path, "w");
+    if ( out == NULL || fwrite(data, 1, size, out) != (size_t)size ) {
+        perror(path);
+        exit(1);
+    }
+    fclose(out);
+}
+
+static char* read_file(const char* path, long* size) {
+    FILE* in = fopen(path, "r");
+    *size = file_size(path);
+    char* data = malloc(*size > 0 ? *size : 1);
+    if ( in == NULL || data == NULL || fread(data, 1, *size, in) != (size_t)*size ) {
+        perror(path);
+        exit(1);
+    }
+    fclose(in);
+    return data;
+}
+
+// The first action the cache offers a new game on map, before it moves
+static char first_action(const char* path, const char* map) {
+    struct PlanCache* cache = cache_open((char*)path);
+    struct Game game;
+
+    game_start(&game, map);
+    char action = cache_next_action(cache, game.wm, game.history, 0);
+    game_end(&game);
+    cache_close(cache);
+    return action;
+}
+
+// Count the records in a cache file, walking them by their sizes.
+// Returns -1 if they don't add up to the file.
+static int count_records(const char* path) {
+    long size, offset = sizeof(struct CacheHeader);
+    char* data = read_file(path, &size);
+    int n = 0;
+
+    while ( offset + (long)sizeof(struct CacheRecord) <= size ) {
+        struct CacheRecord* record = (struct CacheRecord*)(data + offset);
+        if ( record->size <= 0 || offset + record->size > size ) {
+            break;
+        }
+        offset += record->size;
+        n++;
+    }
+
+    free(data);
+    return offset == size ? n : -1;
+}
+
+// Whether any tile we haven't seen is filled in
+static bool assumes_any(struct WorldModel* wm) {
+    int x, y;
+
+    for ( y = 0; y < GRID_SIZE; y++ ) {
+        for ( x = 0; x < GRID_SIZE; x++ ) {
+            if ( wm_get_seen_tile(wm, pos_set(x, y)) == TILE_UNKNOWN &&
+                 wm_get_tile(wm, pos_set(x, y)) != TILE_UNKNOWN ) {
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+int main( void ) {
+    static char plan[MAX_PATH_LEN];
+    char dir[] = "/tmp/test_cache_XXXXXX";
+    char path[64], bad_path[64], shared_path[64];
+    struct PlanCache* cache;
+    struct Game game;
+    long states, size;
+    int i;
+
+    if ( mkdtemp(dir) == NULL ) {
+        perror(dir);
+        return 1;
+    }
+    snprintf(path, sizeof(path), "%s/cache", dir);
+    snprintf(bad_path, sizeof(bad_path), "%s/bad", dir);
+    snprintf(shared_path, sizeof(shared_path), "%s/shared", dir);
+
+    // The shortest win on the map, to play and keep
+    struct WorldModel* solve_wm = load(map_a);
+    int n_plan = wm_solve(solve_wm, plan, 1, 0, &states);
+    wm_destroy(solve_wm);
+    if ( n_plan <= 0 ) {
+        fprintf(stderr, "test_cache: no win on the map\n");
+        return 1;
+    }
+
+    // A file that isn't there is an empty cache
+    cache = cache_open(path);
+    game_start(&game, map_a);
+    check(cache != NULL, "no cache for a missing file");
+    check(cache_next_action(cache, game.wm, game.history, 0) == '\0', "a plan from an empty cache");
+    check(!cache_fill_map(cache, game.wm) && wm_get_tile(game.wm, far_corner) == TILE_UNKNOWN,
+          "a map from an empty cache");
+    cache_close(cache);
+
+    // Win a game and keep it
+    for ( i = 0; i < n_plan; i++ ) {
+        game_act(&game, plan[i]);
+    }
+    check(cache_record(path, game.wm, game.history, game.n_history), "recording a won game failed");
+    check(count_records(path) == 1, "the recorded file doesn't hold one record");
+    game_end(&game);
+
+    // Reopened, the cache fills in the map and plays the game back
+    cache = cache_open(path);
+    game_start(&game, map_a);
+    check(!cache_fill_map(cache, game.wm), "filling in a fresh game took tiles back");
+    check(wm_get_tile(game.wm, far_corner) == TILE_LAND, "the far corner wasn't filled in");
+    check(wm_get_seen_tile(game.wm, far_corner) == TILE_UNKNOWN, "a filled in tile counts as seen");
+    for ( i = 0; i < n_plan; i++ ) {
+        check(!cache_fill_map(cache, game.wm), "the map stopped fitting its own game");
+        char action = cache_next_action(cache, game.wm, game.history, game.n_history);
+        if ( action != plan[i] ) {
+            fprintf(stderr, "test_cache: replay gave '%c' for '%c' at %d\n", action, plan[i], i);
+            failures++;
+            break;
+        }
+        game_act(&game, action);
+    }
+    check(cache_next_action(cache, game.wm, game.history, game.n_history) == '\0',
+          "the replay went on past the end of the plan");
+    game_end(&game);
+    cache_close(cache);
+
+    // A game that starts with another view gets nothing
+    cache = cache_open(path);
+    game_start(&game, map_b);
+    check(!cache_fill_map(cache, game.wm) && wm_get_tile(game.wm, far_corner) == TILE_UNKNOWN,
+          "a map went to a game with another first view");
+    check(cache_next_action(cache, game.wm, game.history, 0) == '\0',
+          "a plan went to a game with another first view");
+    game_end(&game);
+    cache_close(cache);
+
+    // A game whose map turns out different gets the filled in tiles
+    // taken back when it sees the difference
+    cache = cache_open(path);
+    game_start(&game, map_far_wall);
+    cache_fill_map(cache, game.wm);
+    check(wm_get_tile(game.wm, far_corner) == TILE_LAND, "the far corner wasn't filled in");
+    bool took_back = false;
+    for ( i = 0; i < n_plan && !took_back; i++ ) {
+        game_act(&game, plan[i]);
+        took_back = cache_fill_map(cache, game.wm);
+    }
+    check(took_back, "the wrong map was never taken back");
+    check(wm_get_tile(game.wm, far_corner) == TILE_WALL, "the far corner isn't what we saw");
+    check(!assumes_any(game.wm), "tiles from the wrong map are still filled in");
+    check(cache_next_action(cache, game.wm, game.history, game.n_history) == '\0',
+          "the plan for the wrong map is still followed");
+    game_end(&game);
+    cache_close(cache);
+
+    // Records cut short or claiming more than they hold are skipped,
+    // along with anything after them
+    char* good = read_file(path, &size);
+    char* bad = malloc(2 * size);
+    if ( bad == NULL ) {
+        return 1;
+    }
+
+    memcpy(bad, good, size);
+    memcpy(bad + size, good + sizeof(struct CacheHeader), size - sizeof(struct CacheHeader));
+    write_file(bad_path, bad, size + sizeof(struct CacheRecord) + 4);
+    check(first_action(bad_path, map_a) == plan[0], "a cut short record hid the good one");
+
+    memcpy(bad, good, size);
+    ((struct CacheRecord*)(bad + sizeof(struct CacheHeader)))->size = 1 << 30;
+    write_file(bad_path, bad, size);
+    check(first_action(bad_path, map_a) == '\0', "a record bigger than the file was used");
+
+    memcpy(bad, good, size);
+    ((struct CacheRecord*)(bad + sizeof(struct CacheHeader)))->width = -1;
+    write_file(bad_path, bad, size);
+    check(first_action(bad_path, map_a) == '\0', "a record with no width was used");
+
+    memcpy(bad, good, size);
+    ((struct CacheRecord*)(bad + sizeof(struct CacheHeader)))->n_actions = 1 << 30;
+    write_file(bad_path, bad, size);
+    check(first_action(bad_path, map_a) == '\0', "a record with too many actions was used");
+
+    // A file with another header is left alone
+    memcpy(bad, good, size);
+    ((struct CacheHeader*)bad)->magic ^= 1;
+    write_file(bad_path, bad, size);
+    check(first_action(bad_path, map_a) == '\0', "a file with the wrong magic was used");
+    game_start(&game, map_a);
+    for ( i = 0; i < n_plan; i++ ) {
+        game_act(&game, plan[i]);
+    }
+    check(!cache_record(bad_path, game.wm, game.history, game.n_history) && file_size(bad_path) == size,
+          "a record went on the end of a file with the wrong magic");
+
+    // Writers adding records at once each get theirs in whole
+    pid_t writers[N_WRITERS];
+    for ( i = 0; i < N_WRITERS; i++ ) {
+        writers[i] = fork();
+        if ( writers[i] == 0 ) {
+            _exit(cache_record(shared_path, game.wm, game.history, game.n_history) ? 0 : 1);
+        }
+    }
+    for ( i = 0; i < N_WRITERS; i++ ) {
+        int status;
+        check(writers[i] > 0 && waitpid(writers[i], &status, 0) == writers[i] &&
+              WIFEXITED(status) && WEXITSTATUS(status) == 0, "a writer failed");
+    }
+    check(count_records(shared_path) == N_WRITERS, "records written at once didn't all fit together");
+    check(first_action(shared_path, map_a) == plan[0], "records written at once can't be replayed");
+    game_end(&game);
+
+    free(good);
+    free(bad);
+    unlink(path);
+    unlink(bad_path);
+    unlink(shared_path);
+    rmdir(dir);
+
+    printf("test_cache: %d failures\n", failures);
+    return failures > 0;
+}
@@ -0,0 +1,197 @@
+/*********************************************
+ *  test_poi.c
+ *  A tour of the points of interest must be a win the engine would let
+ *  us play, found whenever the grid search finds one, and no longer than
+ *  the grid search's. Holds wm_poi_win up against wm_plan on small maps
+ *  known in full, by foot, on stones and by raft.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+
+#include "worldmodel.h"
+
+struct Case {
+    const char* map;
+    const char* before;   // actions to take before planning
+};
+
+static const struct Case cases[] = {
+    // A key for the door and an axe for the tree
+    { "**********\n"
+      "*k  *   $*\n"
+      "*   -    *\n"
+      "*a  ******\n"
+      "* ^ T    *\n"
+      "**********\n", "" },
+
+    // Stones across the water and one more on the far side
+    { "*********\n"
+      "* o ~~ $*\n"
+      "* ^o~~ o*\n"
+      "*********\n", "" },
+
+    // Out to the island by raft and back on a raft chopped there
+    { "***********\n"
+      "*a T ~~~  *\n"
+      "*    ~~~ $*\n"
+      "* ^  ~~~ T*\n"
+      "***********\n", "" },
+
+    // The same, planned from out on the water
+    { "***********\n"
+      "*a T ~~~  *\n"
+      "*    ~~~ $*\n"
+      "* ^  ~~~ T*\n"
+      "***********\n", "fflfrrfcfff" },
+
+    // A stone goes in before the raft
+    { "**********\n"
+      "*a T ~  $*\n"
+      "* ^o ~ T *\n"
+      "**********\n", "" },
+};
+
+static int failures = 0;
+
+static void check(bool ok, int n, const char* what) {
+    if ( !ok ) {
+        fprintf(stderr, "test_poi: case %d: %s\n", n, what);
+        failures++;
+    }
+}
+
+// A world model that knows the whole map and keeps its points of
+// interest, as the agent's own does
+static struct WorldModel* known_map(struct WorldModel* truth) {
+    char view[VIEW_SIZE][VIEW_SIZE];
+    int i, j, x, y;
+
+    for ( i = 0; i < VIEW_SIZE; i++ ) {
+        for ( j = 0; j < VIEW_SIZE; j++ ) {
+            view[i][j] = wm_get_tile(truth, pos_set(HOME_POS - VIEW_DIST + j, HOME_POS - VIEW_DIST + i));
+        }
+    }
+
+    struct WorldModel* wm = wm_create(view);
+    if ( wm == NULL ) {
+        exit(1);
+    }
+    for ( y = 0; y < GRID_SIZE; y++ ) {
+        for ( x = 0; x < GRID_SIZE; x++ ) {
+            char tile = wm_get_tile(truth, pos_set(x, y));
+            if ( tile != TILE_OOB && wm_get_tile(wm, pos_set(x, y)) != tile ) {
+                wm_set_tile(wm, pos_set(x, y), tile);
+            }
+        }
+    }
+    return wm;
+}
+
+static int count_steps(const char* actions) {
+    int steps = 0;
+
+    for ( ; *actions != '\0'; actions++ ) {
+        steps += ( *actions == ACTION_FORWARD );
+    }
+    return steps;
+}
+
+// Where we are and what we hold, followed alongside the world model,
+// which keeps its own to itself
+struct Walker {
+    struct Pos pos;
+    Direction dir;
+    bool treasure;
+};
+
+// Play actions on play, checking every step forward is one the engine
+// would allow
+static bool play_actions(struct WorldModel* play, struct Walker* walker, const char* actions) {
+    for ( ; *actions != '\0'; actions++ ) {
+        struct Pos forward_pos = pos_forward_rel(walker->pos, 1, walker->dir);
+
+        switch ( *actions ) {
+            case ACTION_FORWARD:
+                if ( !wm_walk_test_permissible(play, forward_pos, GOAL_WIN) ) {
+                    return false;
+                }
+                walker->treasure |= ( wm_get_tile(play, forward_pos) == TILE_TREASURE );
+                walker->pos = forward_pos;
+                break;
+            case ACTION_LEFT:
+                walker->dir = dir_turn_left(walker->dir);
+                break;
+            case ACTION_RIGHT:
+                walker->dir = dir_turn_right(walker->dir);
+                break;
+        }
+        wm_take_action(play, *actions);
+    }
+    return true;
+}
+
+// Whether playing the actions before and then the tour on the map wins
+static bool plays_to_win(struct WorldModel* truth, const char* before, const char* tour) {
+    struct WorldModel* play = wm_copy(truth);
+    struct Walker walker = { pos_set(HOME_POS, HOME_POS), DIRECTION_UP, false };
+
+    if ( play == NULL ) {
+        exit(1);
+    }
+
+    bool ok = play_actions(play, &walker, before) && play_actions(play, &walker, tour) &&
+              walker.treasure && pos_equal(walker.pos, pos_set(HOME_POS, HOME_POS));
+    wm_destroy(play);
+    return ok;
+}
+
+int main( void ) {
+    static char poi_actions[MAX_PATH_LEN];
+    static char plan_actions[MAX_PATH_LEN];
+    static struct Plan plan;
+    int n_cases = sizeof(cases) / sizeof(cases[0]);
+    int n;
+    const char* action;
+
+    for ( n = 0; n < n_cases; n++ ) {
+        FILE* in = fmemopen((void*)cases[n].map, strlen(cases[n].map), "r");
+        struct WorldModel* truth = wm_load_map(in);
+        fclose(in);
+        if ( truth == NULL ) {
+            return 1;
+        }
+
+        struct WorldModel* wm = known_map(truth);
+        for ( action = cases[n].before; *action != '\0'; action++ ) {
+            wm_take_action(wm, *action);
+        }
+
+        plan.goal = GOAL_WIN;
+        plan.new_req = 0;
+        bool planned = ( wm_plan(wm, &plan, 1) == 0 );
+        bool toured = wm_poi_win(wm, poi_actions);
+
+        check(planned, n, "the grid search found no win");
+        check(toured || !planned, n, "no tour, but the grid search found a win");
+        if ( toured ) {
+            check(plays_to_win(truth, cases[n].before, poi_actions), n, "the tour isn't a win");
+        }
+        if ( toured && planned ) {
+            wm_plan_path(&plan, plan_actions);
+            if ( count_steps(poi_actions) > count_steps(plan_actions) ) {
+                fprintf(stderr, "test_poi: case %d: tour %s is longer than plan %s\n",
+                        n, poi_actions, plan_actions);
+                failures++;
+            }
+        }
+
+        wm_destroy(wm);
+        wm_destroy(truth);
+    }
+
+    printf("test_poi: %d cases, %d failures\n", n_cases, failures);
+    return failures > 0;
+}
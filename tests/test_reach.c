@@ -0,0 +1,353 @@
+/*********************************************
+ *  test_reach.c
+ *  The reachability checks must never rule out a goal the searches can
+ *  meet. Walks the agent about small maps at random, seeing only what it
+ *  would have seen, and at every step holds each check up against the
+ *  search it stands in for, and wm_reach up against a flood one tile at
+ *  a time.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+
+#include "worldmodel.h"
+
+#define N_WALKS 8
+#define N_STEPS 100
+
+static const char* maps[] = {
+    // Chop a tree, sail out to the treasure and get back with the stone
+    "***********\n"
+    "*a  T ~~~ *\n"
+    "*   T ~$~ *\n"
+    "* ^ T ~~~ *\n"
+    "*   T     *\n"
+    "*k  -  o  *\n"
+    "***********\n",
+
+    // Doors, trees and a pool to get lost in
+    "**********\n"
+    "*  *  $  *\n"
+    "* **-*****\n"
+    "*  T  k  *\n"
+    "*^ * **T *\n"
+    "*  a  o~~*\n"
+    "*~~~  *~~*\n"
+    "**********\n",
+
+    // Open water all round, with rafts to be had
+    "***********\n"
+    "*~~~~~~~~~*\n"
+    "*~ T ~ T ~*\n"
+    "*~ a ~ $ ~*\n"
+    "*~ ^ ~ o ~*\n"
+    "*~~~~~~~~~*\n"
+    "***********\n",
+};
+
+// Where the walker is and what it holds, followed alongside the world
+// model, which keeps its own to itself
+struct Walker {
+    struct Pos pos;
+    Direction dir;
+    bool axe;
+    bool key;
+    bool treasure;
+    bool raft;
+    int stones;
+};
+
+static unsigned long long rng_state;
+
+static int rng_next(int n) {
+    rng_state ^= rng_state >> 12;
+    rng_state ^= rng_state << 25;
+    rng_state ^= rng_state >> 27;
+    return (int)((rng_state * 0x2545f4914f6cdd1dULL) >> 33) % n;
+}
+
+// Show the tiles around pos
+static void reveal(bool (*revealed)[GRID_SIZE], struct Pos pos) {
+    int i, j;
+
+    for ( i = -VIEW_DIST; i <= VIEW_DIST; i++ ) {
+        for ( j = -VIEW_DIST; j <= VIEW_DIST; j++ ) {
+            revealed[pos.y + i][pos.x + j] = true;
+        }
+    }
+}
+
+// The world as the agent knows it, with everything it hasn't seen unknown
+static struct WorldModel* known_copy(struct WorldModel* truth, bool (*revealed)[GRID_SIZE]) {
+    struct WorldModel* known = wm_copy(truth);
+    int x, y;
+
+    for ( y = 0; y < GRID_SIZE; y++ ) {
+        for ( x = 0; x < GRID_SIZE; x++ ) {
+            if ( !revealed[y][x] ) {
+                wm_set_tile(known, pos_set(x, y), TILE_UNKNOWN);
+            }
+        }
+    }
+    return known;
+}
+
+// Pick an action the engine would let the walker take without drowning
+static char random_action(struct WorldModel* known, struct Walker* walker) {
+    static const char actions[] = { ACTION_FORWARD, ACTION_FORWARD, ACTION_FORWARD,
+                                    ACTION_LEFT, ACTION_RIGHT, ACTION_CHOP, ACTION_UNLOCK };
+    struct Pos forward_pos = pos_forward_rel(walker->pos, 1, walker->dir);
+    char forward_tile = wm_get_tile(known, forward_pos);
+
+    while ( true ) {
+        char action = actions[rng_next(sizeof(actions))];
+        switch ( action ) {
+            case ACTION_FORWARD:
+                if ( forward_tile != TILE_TREE && forward_tile != TILE_DOOR &&
+                     wm_walk_test_permissible(known, forward_pos, GOAL_WIN) ) {
+                    return action;
+                }
+                break;
+            case ACTION_CHOP:
+                if ( forward_tile == TILE_TREE && walker->axe ) {
+                    return action;
+                }
+                break;
+            case ACTION_UNLOCK:
+                if ( forward_tile == TILE_DOOR && walker->key ) {
+                    return action;
+                }
+                break;
+            default:
+                return action;
+        }
+    }
+}
+
+static void walker_take_action(struct Walker* walker, struct WorldModel* truth, char action) {
+    struct Pos forward_pos = pos_forward_rel(walker->pos, 1, walker->dir);
+
+    switch ( action ) {
+        case ACTION_FORWARD:
+            switch ( wm_get_tile(truth, forward_pos) ) {
+                case TILE_AXE:      walker->axe = true;      break;
+                case TILE_KEY:      walker->key = true;      break;
+                case TILE_TREASURE: walker->treasure = true; break;
+                case TILE_STONE:    walker->stones++;        break;
+                case TILE_WATER:
+                    if ( wm_get_tile(truth, walker->pos) == TILE_WATER ) {
+                        break;
+                    }
+                    if ( walker->stones > 0 ) {
+                        walker->stones--;
+                    } else {
+                        walker->raft = false;
+                    }
+                    break;
+            }
+            walker->pos = forward_pos;
+            break;
+        case ACTION_CHOP:
+            walker->raft = true;
+            break;
+        case ACTION_LEFT:
+            walker->dir = dir_turn_left(walker->dir);
+            break;
+        case ACTION_RIGHT:
+            walker->dir = dir_turn_right(walker->dir);
+            break;
+    }
+    wm_take_action(truth, action);
+}
+
+// Whether the walker has seen the treasure, without which there's no
+// win to find and the search for one only takes up time
+static bool treasure_known(struct WorldModel* known) {
+    int x, y;
+
+    for ( y = 0; y < GRID_SIZE; y++ ) {
+        for ( x = 0; x < GRID_SIZE; x++ ) {
+            if ( wm_get_tile(known, pos_set(x, y)) == TILE_TREASURE ) {
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+// Whether the rules let a walk cross the tile
+static bool rules_cross(int rules, char tile) {
+    switch ( tile ) {
+        case TILE_LAND:
+        case TILE_HOME:
+        case TILE_USED_STONE:
+        case TILE_AXE:
+        case TILE_KEY:
+        case TILE_TREASURE: return rules & REACH_LAND;
+        case TILE_WATER:    return rules & REACH_WATER;
+        case TILE_TREE:     return rules & REACH_TREES;
+        case TILE_DOOR:     return rules & REACH_DOORS;
+        case TILE_STONE:    return rules & REACH_STONES;
+    }
+    return false;
+}
+
+// Flood out from the walker a tile at a time, taking up the items it
+// comes to as wm_reach does with REACH_ITEMS
+static void flood(struct WorldModel* known, struct Walker* walker, int rules,
+                  bool (*reached)[GRID_SIZE]) {
+    static struct Pos stack[(GRID_SIZE) * (GRID_SIZE)];
+    int old_rules, n, x, y;
+    Direction dir;
+
+    do {
+        old_rules = rules;
+        memset(reached, 0, sizeof(bool) * (GRID_SIZE) * (GRID_SIZE));
+        reached[walker->pos.y][walker->pos.x] = true;
+        stack[0] = walker->pos;
+        n = 1;
+        while ( n > 0 ) {
+            struct Pos pos = stack[--n];
+            for ( dir = 0; dir < 4; dir++ ) {
+                struct Pos next = pos_forward_rel(pos, 1, dir);
+                if ( !reached[next.y][next.x] && rules_cross(rules, wm_get_tile(known, next)) ) {
+                    reached[next.y][next.x] = true;
+                    stack[n++] = next;
+                }
+            }
+        }
+
+        if ( rules & REACH_ITEMS ) {
+            bool axe = walker->axe, key = walker->key;
+            bool tree = false, stone = walker->stones > 0;
+            for ( y = 0; y < GRID_SIZE; y++ ) {
+                for ( x = 0; x < GRID_SIZE; x++ ) {
+                    char tile = wm_get_tile(known, pos_set(x, y));
+                    if ( !reached[y][x] ) {
+                        continue;
+                    }
+                    axe |= tile == TILE_AXE;
+                    key |= tile == TILE_KEY;
+                    tree |= tile == TILE_TREE;
+                    stone |= tile == TILE_STONE;
+                }
+            }
+            if ( axe )                                       rules |= REACH_TREES;
+            if ( key )                                       rules |= REACH_DOORS;
+            if ( walker->raft || ( axe && tree ) || stone ) rules |= REACH_WATER;
+        }
+    } while ( rules != old_rules );
+}
+
+// Hold wm_reach up against the flood for a few sets of rules. Returns the
+// number of rules it got a tile wrong for.
+static int check_reach(struct WorldModel* known, struct Walker* walker, int map, int walk,
+                       char* history) {
+    static const int rule_sets[] = {
+        REACH_LAND,
+        REACH_LAND | REACH_WATER,
+        REACH_LAND | REACH_TREES | REACH_DOORS | REACH_STONES,
+        REACH_LAND | REACH_STONES | REACH_ITEMS,
+        REACH_LAND | REACH_WATER | REACH_TREES | REACH_DOORS | REACH_STONES,
+    };
+    static bool reached[GRID_SIZE][GRID_SIZE];
+    static struct Reach reach;
+    int i, x, y, failures = 0;
+
+    for ( i = 0; i < (int)(sizeof(rule_sets) / sizeof(rule_sets[0])); i++ ) {
+        wm_reach(known, rule_sets[i], &reach);
+        flood(known, walker, rule_sets[i], reached);
+        for ( y = 0; y < GRID_SIZE; y++ ) {
+            for ( x = 0; x < GRID_SIZE; x++ ) {
+                if ( reach_test(&reach, pos_set(x, y)) != reached[y][x] ) {
+                    break;
+                }
+            }
+            if ( x < GRID_SIZE ) {
+                break;
+            }
+        }
+        if ( y < GRID_SIZE ) {
+            fprintf(stderr, "map %d walk %d after '%s': rules %d %s (%d, %d)\n",
+                    map, walk, history, rule_sets[i],
+                    reached[y][x] ? "missed" : "wrongly reached", x, y);
+            failures++;
+        }
+    }
+    return failures;
+}
+
+// Hold the checks up against the searches. Returns the number of checks
+// that ruled out a goal the searches met.
+static int check_goals(struct WorldModel* known, int map, int walk, char* history) {
+    static char actions[MAX_PATH_LEN];
+    struct ReachGoals goals;
+    int failures = 0;
+
+    wm_reach_goals(known, &goals);
+
+    if ( !goals.win && treasure_known(known) && wm_walk(known, actions, GOAL_WIN, 0) ) {
+        fprintf(stderr, "map %d walk %d after '%s': win ruled out, but found %s\n",
+                map, walk, history, actions);
+        failures++;
+    }
+    if ( goals.new_tiles < 10 && wm_walk(known, actions, GOAL_DEPTH, goals.new_tiles + 1) ) {
+        fprintf(stderr, "map %d walk %d after '%s': %d new tiles, but found %d with %s\n",
+                map, walk, history, goals.new_tiles, goals.new_tiles + 1, actions);
+        failures++;
+    }
+    if ( !goals.explore && wm_explore(known, actions) ) {
+        fprintf(stderr, "map %d walk %d after '%s': exploring ruled out, but found %s\n",
+                map, walk, history, actions);
+        failures++;
+    }
+    return failures;
+}
+
+int main( void ) {
+    static bool revealed[GRID_SIZE][GRID_SIZE];
+    char history[N_STEPS + 1];
+    int n_maps = sizeof(maps) / sizeof(maps[0]);
+    int map, walk, step, failures = 0, checks = 0;
+
+    for ( map = 0; map < n_maps; map++ ) {
+        for ( walk = 0; walk < N_WALKS; walk++ ) {
+            struct Walker walker = { pos_set(HOME_POS, HOME_POS), DIRECTION_UP,
+                                     false, false, false, false, 0 };
+            rng_state = 0x9e3779b97f4a7c15ULL * (map * N_WALKS + walk + 1);
+
+            FILE* in = fmemopen((void*)maps[map], strlen(maps[map]), "r");
+            struct WorldModel* truth = wm_load_map(in);
+            fclose(in);
+            if ( truth == NULL ) {
+                return 1;
+            }
+
+            memset(revealed, 0, sizeof(revealed));
+            reveal(revealed, walker.pos);
+            history[0] = '\0';
+
+            for ( step = 0; step < N_STEPS && !walker.treasure; step++ ) {
+                struct WorldModel* known = known_copy(truth, revealed);
+                failures += check_goals(known, map, walk, history);
+                failures += check_reach(known, &walker, map, walk, history);
+                checks++;
+
+                char action = random_action(known, &walker);
+                wm_destroy(known);
+
+                walker_take_action(&walker, truth, action);
+                reveal(revealed, walker.pos);
+                history[step] = action;
+                history[step + 1] = '\0';
+            }
+
+            wm_destroy(truth);
+        }
+    }
+
+    printf("test_reach: %d checks, %d failures\n", checks, failures);
+    return failures > 0;
+}
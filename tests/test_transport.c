@@ -0,0 +1,254 @@
+/*********************************************
+ *  test_transport.c
+ *  Loopback test of the shared memory transport. A forked engine sends
+ *  many ring fulls of bytes for the agent to echo back, then ends the
+ *  game, and the agent must see end of file rather than wait forever.
+ *  The channel starts out as one a crashed run left behind, which must
+ *  be made afresh. Then times a game's worth of views and actions over
+ *  each transport, to compare shared memory with the sockets.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#include "transport.h"
+
+#define CHUNK    3000
+#define N_CHUNKS 50
+
+// A view is the 24 tiles around the agent, and the answer one action
+#define VIEW_BYTES    24
+#define N_ROUND_TRIPS 20000
+
+static char name[64];
+
+static char pattern(int i) {
+    return (char)(i * 31 + i / 251);
+}
+
+// Leave a channel behind as a crashed run would, made by a process that
+// has gone, with the rings mid-game
+static void leave_stale_channel(void) {
+    pid_t pid = fork();
+    if ( pid == 0 ) {
+        _exit(0);
+    }
+    waitpid(pid, NULL, 0);
+
+    int fd = shm_open(name, O_RDWR | O_CREAT | O_TRUNC, 0600);
+    if ( fd < 0 || ftruncate(fd, sizeof(struct ShmChannel)) < 0 ) {
+        perror(name);
+        exit(1);
+    }
+    struct ShmChannel* channel = mmap(NULL, sizeof(struct ShmChannel),
+            PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if ( channel == MAP_FAILED ) {
+        perror(name);
+        exit(1);
+    }
+
+    channel->creator = pid;
+    channel->to_agent.head = 1234;
+    channel->to_agent.tail = 17;
+    channel->to_agent.writer_waiting = 1;
+    channel->to_engine.head = 99;
+    channel->to_engine.closed = 1;
+    munmap(channel, sizeof(struct ShmChannel));
+}
+
+// Send chunks and check they come back, then end the game
+static int engine(void) {
+    static char sent[CHUNK], echoed[CHUNK];
+    FILE *in, *out;
+    int chunk, i;
+
+    transport_open_engine(name, &in, &out);
+
+    for ( chunk = 0; chunk < N_CHUNKS; chunk++ ) {
+        for ( i = 0; i < CHUNK; i++ ) {
+            sent[i] = pattern(chunk * CHUNK + i);
+        }
+        if ( fwrite(sent, 1, CHUNK, out) != CHUNK || fflush(out) != 0 ||
+             fread(echoed, 1, CHUNK, in) != CHUNK ) {
+            fprintf(stderr, "engine: short transfer in chunk %d\n", chunk);
+            return 1;
+        }
+        if ( memcmp(sent, echoed, CHUNK) != 0 ) {
+            fprintf(stderr, "engine: chunk %d came back wrong\n", chunk);
+            return 1;
+        }
+    }
+
+    fclose(out);
+    return 0;
+}
+
+// Answer every view with an action until the game ends, as the agent does
+static int latency_agent(Transport transport, char* addr) {
+    FILE *in, *out;
+    int i;
+
+    transport_open(transport, addr, &in, &out);
+    while ( true ) {
+        for ( i = 0; i < VIEW_BYTES; i++ ) {
+            if ( getc(in) == EOF ) {
+                return 0;
+            }
+        }
+        putc('f', out);
+        fflush(out);
+    }
+}
+
+// Send views and wait for the actions, and return the mean round trip in
+// microseconds, or -1 if a transfer fell short
+static double latency_engine(FILE* in, FILE* out) {
+    static char view[VIEW_BYTES];
+    struct timespec start, end;
+    int i;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for ( i = 0; i < N_ROUND_TRIPS; i++ ) {
+        if ( fwrite(view, 1, VIEW_BYTES, out) != VIEW_BYTES || fflush(out) != 0 || getc(in) != 'f' ) {
+            return -1;
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    return ( (end.tv_sec - start.tv_sec) * 1e9 + (end.tv_nsec - start.tv_nsec) ) / 1e3 / N_ROUND_TRIPS;
+}
+
+// Time a game over the transport. Socket transports listen on a socket
+// of the given family and pass the agent its port or path.
+static double latency(Transport transport) {
+    struct sockaddr_storage addr;
+    socklen_t addr_len;
+    char agent_addr[64];
+    FILE *in, *out;
+    int sd = -1, status, one = 1;
+
+    memset(&addr, 0, sizeof(addr));
+    if ( transport == TRANSPORT_TCP ) {
+        struct sockaddr_in* in_addr = (struct sockaddr_in*)&addr;
+        in_addr->sin_family = AF_INET;
+        in_addr->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        addr_len = sizeof(*in_addr);
+    } else if ( transport == TRANSPORT_UNIX ) {
+        struct sockaddr_un* un_addr = (struct sockaddr_un*)&addr;
+        un_addr->sun_family = AF_UNIX;
+        snprintf(agent_addr, sizeof(agent_addr), "/tmp/test_transport_%d", (int)getpid());
+        strcpy(un_addr->sun_path, agent_addr);
+        unlink(agent_addr);
+        addr_len = sizeof(*un_addr);
+    } else {
+        snprintf(agent_addr, sizeof(agent_addr), "/test_transport_latency_%d", (int)getpid());
+    }
+
+    if ( transport != TRANSPORT_SHM ) {
+        sd = socket(addr.ss_family, SOCK_STREAM, 0);
+        if ( sd < 0 || bind(sd, (struct sockaddr*)&addr, addr_len) < 0 || listen(sd, 1) < 0 ||
+             getsockname(sd, (struct sockaddr*)&addr, &addr_len) < 0 ) {
+            perror("test_transport: cannot listen ");
+            return -1;
+        }
+        if ( transport == TRANSPORT_TCP ) {
+            snprintf(agent_addr, sizeof(agent_addr), "%d", ntohs(((struct sockaddr_in*)&addr)->sin_port));
+        }
+    }
+
+    pid_t pid = fork();
+    if ( pid == 0 ) {
+        _exit(latency_agent(transport, agent_addr));
+    }
+
+    if ( transport == TRANSPORT_SHM ) {
+        transport_open_engine(agent_addr, &in, &out);
+    } else {
+        int conn = accept(sd, NULL, NULL);
+        close(sd);
+        if ( conn < 0 ) {
+            perror("test_transport: cannot accept ");
+            return -1;
+        }
+        if ( transport == TRANSPORT_TCP ) {
+            setsockopt(conn, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        }
+        in  = fdopen(conn, "r");
+        out = fdopen(dup(conn), "w");
+    }
+
+    double micros = latency_engine(in, out);
+    fclose(out);
+    fclose(in);
+    waitpid(pid, &status, 0);
+
+    if ( transport == TRANSPORT_SHM ) {
+        shm_unlink(agent_addr);
+    } else if ( transport == TRANSPORT_UNIX ) {
+        unlink(agent_addr);
+    }
+
+    return WIFEXITED(status) && WEXITSTATUS(status) == 0 ? micros : -1;
+}
+
+int main( void ) {
+    FILE *in, *out;
+    int ch, n = 0, status;
+
+    snprintf(name, sizeof(name), "/test_transport_%d", (int)getpid());
+    leave_stale_channel();
+
+    pid_t pid = fork();
+    if ( pid == 0 ) {
+        exit(engine());
+    }
+
+    // Fail rather than hang if end of file never comes
+    alarm(10);
+
+    transport_open(TRANSPORT_SHM, name, &in, &out);
+    while ( (ch = getc(in)) != EOF ) {
+        if ( (char)ch != pattern(n) ) {
+            fprintf(stderr, "agent: byte %d came through wrong\n", n);
+            return 1;
+        }
+        putc(ch, out);
+        fflush(out);
+        n++;
+    }
+
+    waitpid(pid, &status, 0);
+    shm_unlink(name);
+
+    if ( n != CHUNK * N_CHUNKS || !WIFEXITED(status) || WEXITSTATUS(status) != 0 ) {
+        fprintf(stderr, "test_transport: echoed %d of %d bytes\n", n, CHUNK * N_CHUNKS);
+        return 1;
+    }
+    printf("test_transport: echoed %d bytes, then end of file\n", n);
+
+    // Times only, since they depend on the machine. Any transfer that
+    // falls short fails.
+    double tcp = latency(TRANSPORT_TCP);
+    double unix_socket = latency(TRANSPORT_UNIX);
+    double shm = latency(TRANSPORT_SHM);
+    if ( tcp < 0 || unix_socket < 0 || shm < 0 ) {
+        fprintf(stderr, "test_transport: a timed game fell short\n");
+        return 1;
+    }
+    printf("test_transport: round trip %.1fus over TCP, %.1fus over a Unix socket, %.1fus over shared memory\n",
+           tcp, unix_socket, shm);
+    return 0;
+}
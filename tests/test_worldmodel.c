@@ -0,0 +1,70 @@
+/*********************************************
+ *  test_worldmodel.c
+ *  The world model must follow what the engine does with our items when
+ *  we step into the water: a stone if we hold one, otherwise the raft.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+
+#include "worldmodel.h"
+
+static int failures = 0;
+
+static struct WorldModel* load(const char* map) {
+    FILE* in = fmemopen((void*)map, strlen(map), "r");
+    struct WorldModel* wm = wm_load_map(in);
+    fclose(in);
+    if ( wm == NULL ) {
+        exit(1);
+    }
+    return wm;
+}
+
+static void take_actions(struct WorldModel* wm, const char* actions) {
+    for ( ; *actions != '\0'; actions++ ) {
+        wm_take_action(wm, *actions);
+    }
+}
+
+static void check(bool ok, const char* what) {
+    if ( !ok ) {
+        fprintf(stderr, "test_worldmodel: %s\n", what);
+        failures++;
+    }
+}
+
+int main( void ) {
+    struct Pos water = pos_set(HOME_POS, HOME_POS - 1);
+    struct WorldModel* wm;
+
+    // With no stones, sailing in takes the raft and leaves the water as
+    // it was. Back on land there's nothing left to cross it with.
+    wm = load("*****\n"
+              "*~~~*\n"
+              "*a^T*\n"
+              "*****\n");
+    take_actions(wm, "lfrrfclf");
+    check(wm_get_tile(wm, water) == TILE_WATER, "sailing in with the raft placed a stone");
+    take_actions(wm, "rrfrr");
+    check(!wm_walk_test_permissible(wm, water, GOAL_WIN), "the raft was kept after sailing in");
+    wm_destroy(wm);
+
+    // A stone we hold goes in before the raft
+    wm = load("*****\n"
+              "*~~~*\n"
+              "*a^T*\n"
+              "* o *\n"
+              "*****\n");
+    take_actions(wm, "lfrrfcrfrrff");
+    check(wm_get_tile(wm, water) == TILE_USED_STONE, "stepping in with a stone didn't place it");
+    take_actions(wm, "rrfrr");
+    check(wm_walk_test_permissible(wm, pos_set(HOME_POS - 1, HOME_POS - 1), GOAL_WIN),
+          "the raft went with the stone");
+    wm_destroy(wm);
+
+    printf("test_worldmodel: %d failures\n", failures);
+    return failures > 0;
+}
@@ -0,0 +1,247 @@
+/*********************************************
+ *  transport.c
+ *  Ways of talking to the Game Engine
+*/
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <limits.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+#include "pipe.h"
+#include "transport.h"
+
+static int unixopen(char* path) {
+    int sd;
+    struct sockaddr_un servAddr;
+
+    if ( strlen(path) >= sizeof(servAddr.sun_path) ) {
+        printf("socket path too long '%s'\n", path);
+        exit(1);
+    }
+
+    memset(&servAddr, 0, sizeof(servAddr));
+    servAddr.sun_family = AF_UNIX;
+    strcpy(servAddr.sun_path, path);
+
+    sd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if ( sd < 0 ) {
+        perror("cannot open socket ");
+        exit(1);
+    }
+
+    if ( connect(sd, (struct sockaddr *) &servAddr, sizeof(servAddr)) < 0 ) {
+        perror("cannot connect ");
+        exit(1);
+    }
+
+    return sd;
+}
+
+// Sleep until the other side clears our waiting flag, unless it already has
+static void shm_wait(int* waiting) {
+    syscall(SYS_futex, waiting, FUTEX_WAIT, 1, NULL, NULL, 0);
+}
+
+// Wake the other side if it's waiting. Clearing the flag first means a
+// wake that comes before it sleeps isn't lost.
+static void shm_wake(int* waiting) {
+    if ( __atomic_exchange_n(waiting, 0, __ATOMIC_SEQ_CST) ) {
+        syscall(SYS_futex, waiting, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+    }
+}
+
+// Block until the ring has something to read, then read as much as we can.
+// Returns 0 once the writer has closed the ring and we've read it all.
+static ssize_t shm_read(void* cookie, char* buf, size_t size) {
+    struct ShmRing* ring = cookie;
+    unsigned int tail = ring->tail;
+    unsigned int head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+
+    while ( head == tail ) {
+        if ( __atomic_load_n(&ring->closed, __ATOMIC_ACQUIRE) ) {
+            // Anything written before the ring closed is there by now
+            head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+            if ( head == tail ) {
+                return 0;
+            }
+            break;
+        }
+
+        __atomic_store_n(&ring->reader_waiting, 1, __ATOMIC_SEQ_CST);
+        head = __atomic_load_n(&ring->head, __ATOMIC_SEQ_CST);
+        if ( head == tail && !__atomic_load_n(&ring->closed, __ATOMIC_SEQ_CST) ) {
+            shm_wait(&ring->reader_waiting);
+        }
+        __atomic_store_n(&ring->reader_waiting, 0, __ATOMIC_SEQ_CST);
+        head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    }
+
+    size_t n = 0;
+    while ( n < size && tail != head ) {
+        buf[n++] = ring->data[tail % SHM_RING_SIZE];
+        tail++;
+    }
+
+    __atomic_store_n(&ring->tail, tail, __ATOMIC_SEQ_CST);
+    shm_wake(&ring->writer_waiting);
+
+    return n;
+}
+
+// Write everything, blocking while the ring is full
+static ssize_t shm_write(void* cookie, const char* buf, size_t size) {
+    struct ShmRing* ring = cookie;
+    unsigned int head = ring->head;
+    size_t n = 0;
+
+    while ( n < size ) {
+        unsigned int tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+
+        if ( head - tail == SHM_RING_SIZE ) {
+            __atomic_store_n(&ring->writer_waiting, 1, __ATOMIC_SEQ_CST);
+            tail = __atomic_load_n(&ring->tail, __ATOMIC_SEQ_CST);
+            if ( head - tail == SHM_RING_SIZE ) {
+                shm_wait(&ring->writer_waiting);
+            }
+            __atomic_store_n(&ring->writer_waiting, 0, __ATOMIC_SEQ_CST);
+            continue;
+        }
+
+        while ( n < size && head - tail < SHM_RING_SIZE ) {
+            ring->data[head % SHM_RING_SIZE] = buf[n++];
+            head++;
+        }
+
+        __atomic_store_n(&ring->head, head, __ATOMIC_SEQ_CST);
+        shm_wake(&ring->reader_waiting);
+    }
+
+    return n;
+}
+
+// We're done writing, so the reader gets end of file once it has read
+// everything
+static int shm_close(void* cookie) {
+    struct ShmRing* ring = cookie;
+
+    __atomic_store_n(&ring->closed, 1, __ATOMIC_SEQ_CST);
+    shm_wake(&ring->reader_waiting);
+
+    return 0;
+}
+
+// Whether the process that made the channel has gone, leaving the
+// channel behind with whatever state its run ended in
+static bool shm_stale(int creator) {
+    return kill(creator, 0) < 0 && errno == ESRCH;
+}
+
+// Map the channel, creating it if the other side hasn't yet, or clearing
+// it if the one there is left over from an earlier run
+static struct ShmChannel* shm_channel_open(char* name) {
+    struct ShmChannel* channel;
+    struct stat st;
+    bool created = true;
+
+    int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+    if ( fd < 0 && errno == EEXIST ) {
+        created = false;
+        fd = shm_open(name, O_RDWR, 0600);
+    }
+    if ( fd < 0 ) {
+        perror("cannot open shared memory ");
+        exit(1);
+    }
+
+    // New space reads as zero, which is an empty channel
+    if ( fstat(fd, &st) < 0 ||
+         ( st.st_size < (off_t)sizeof(struct ShmChannel) && ftruncate(fd, sizeof(struct ShmChannel)) < 0 ) ) {
+        perror("cannot size shared memory ");
+        exit(1);
+    }
+
+    channel = mmap(NULL, sizeof(struct ShmChannel), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+
+    if ( channel == MAP_FAILED ) {
+        perror("cannot map shared memory ");
+        exit(1);
+    }
+
+    if ( created ) {
+        __atomic_store_n(&channel->creator, getpid(), __ATOMIC_RELEASE);
+        return channel;
+    }
+
+    while ( true ) {
+        int creator = __atomic_load_n(&channel->creator, __ATOMIC_ACQUIRE);
+
+        if ( creator == 0 ) {
+            // Still being made or cleared by the other side
+            usleep(1000);
+        } else if ( !shm_stale(creator) ) {
+            return channel;
+        } else if ( __atomic_compare_exchange_n(&channel->creator, &creator, 0, false,
+                                                __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE) ) {
+            // Only one side gets to clear it, and the other waits until
+            // it's done
+            memset(&channel->to_agent, 0, sizeof(channel->to_agent));
+            memset(&channel->to_engine, 0, sizeof(channel->to_engine));
+            __atomic_store_n(&channel->creator, getpid(), __ATOMIC_RELEASE);
+            return channel;
+        }
+    }
+}
+
+static void shmopen(char* name, bool engine, FILE** in, FILE** out) {
+    struct ShmChannel* channel = shm_channel_open(name);
+
+    cookie_io_functions_t read_funcs  = { shm_read, NULL, NULL, NULL };
+    cookie_io_functions_t write_funcs = { NULL, shm_write, NULL, shm_close };
+
+    *in  = fopencookie(engine ? &channel->to_engine : &channel->to_agent, "r", read_funcs);
+    *out = fopencookie(engine ? &channel->to_agent : &channel->to_engine, "w", write_funcs);
+
+    if ( *in == NULL || *out == NULL ) {
+        perror("cannot open shared memory streams ");
+        exit(1);
+    }
+}
+
+void transport_open_engine(char* name, FILE** in, FILE** out) {
+    shmopen(name, true, in, out);
+}
+
+void transport_open(Transport transport, char* addr, FILE** in, FILE** out) {
+    int sd;
+
+    switch(transport) {
+        case TRANSPORT_SHM:
+            shmopen(addr, false, in, out);
+            return;
+        case TRANSPORT_UNIX:
+            sd = unixopen(addr);
+            break;
+        case TRANSPORT_TCP:
+        default:
+            sd = tcpopen("localhost", atoi(addr));
+            break;
+    }
+
+    *in  = fdopen(sd, "r");
+    *out = fdopen(sd, "w");
+}
@@ -0,0 +1,61 @@
+/*********************************************
+ *  transport.h
+ *  Ways of talking to the Game Engine
+*/
+
+#ifndef TRANSPORT_H
+#define TRANSPORT_H
+
+#include <stdio.h>
+
+// The engine and agent always run on the same host, so besides the
+// engine's TCP port we can talk over a Unix domain socket, or through
+// a pair of ring buffers in shared memory.
+enum Transport{ TRANSPORT_TCP,
+                TRANSPORT_UNIX,
+                TRANSPORT_SHM };
+
+typedef int Transport;
+
+// Shared memory transport
+// A single producer, single consumer ring of bytes in each direction.
+// head counts the bytes ever written and tail the bytes ever read, so
+// the ring is empty when they are equal and full when they are
+// SHM_RING_SIZE apart. A side that has to wait sets its waiting flag and
+// sleeps on it as a futex; the other side clears the flag and wakes it
+// after moving head or tail. A futex needs nothing but the shared page,
+// where an eventfd would have to be passed between the two processes
+// over a socket, and the agent never waits on anything else that would
+// call for poll. The writer sets closed once it is done for good, after
+// which the reader gets end of file once the ring is empty.
+// Whoever creates the channel puts its pid in creator once it is ready
+// to use, so a channel left behind by a run that has ended can be told
+// apart and cleared. Until then creator is 0 and the other side waits.
+// The engine side of the channel must use the same layout.
+#define SHM_RING_SIZE 4096
+
+struct ShmRing {
+    unsigned int head;
+    unsigned int tail;
+    int reader_waiting;
+    int writer_waiting;
+    int closed;
+    char data[SHM_RING_SIZE];
+};
+
+struct ShmChannel {
+    int creator;
+    struct ShmRing to_agent;
+    struct ShmRing to_engine;
+};
+
+// Open a connection to the engine. addr is the port for TCP, the socket
+// path for Unix sockets and the shm_open name for shared memory.
+// Exits on failure, like tcpopen.
+void transport_open(Transport transport, char* addr, FILE** in, FILE** out);
+
+// The engine's end of a shared memory channel, for engines written in C
+// and for testing. Closing out tells the agent the game is over.
+void transport_open_engine(char* name, FILE** in, FILE** out);
+
+#endif
@@ -2,13 +2,14 @@
 
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include <stdbool.h>
 #include <assert.h>
-
-struct Pos {
-    int x;
-    int y;
-};
+#include <pthread.h>
+#include <limits.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 // Linked list for nodes
 struct PosNode {
@@ -81,6 +82,8 @@ Direction dir_turn_left( Direction dir ) {
     }
 }
 
+struct PoiGraph;
+
 struct WorldModel { // The grid
     char grid[GRID_SIZE][GRID_SIZE];
     bool been[GRID_SIZE][GRID_SIZE];
@@ -94,8 +97,52 @@ struct WorldModel { // The grid
     bool axe;
     bool raft;
     int stones;
+
+    // Summed-area table of unknown tiles, so we can count the unknown
+    // tiles in any rectangle in constant time. unknown_sat[i][j] holds
+    // the number of unknown tiles in grid rows < i and columns < j.
+    // Only the world model made by wm_create keeps one, copies made
+    // while searching get NULL.
+    int (*unknown_sat)[GRID_SIZE + 1];
+
+    // Graph of points of interest, kept up to date as tiles change.
+    // Like unknown_sat, only the world model made by wm_create has one.
+    struct PoiGraph* pois;
+
+    // Every tile as we first saw it, before we picked anything up, chopped
+    // or unlocked it, and unknown for tiles we've only assumed. Only the
+    // world model made by wm_create keeps one.
+    char (*seen)[GRID_SIZE];
 };
 
+static struct PoiGraph* poi_graph_create(struct WorldModel* wm);
+static void poi_graph_destroy(struct PoiGraph* graph);
+static void poi_graph_tile_changed(struct WorldModel* wm, struct Pos pos);
+
+// Bring the summed-area table of unknown tiles up to date after tiles at
+// rows >= top and columns >= left changed. Entries above or to the left
+// of those count none of them, so only the rest are worked out again.
+static void wm_update_unknown_sat(struct WorldModel* wm, int top, int left) {
+    int (*sat)[GRID_SIZE + 1] = wm->unknown_sat;
+    int i, j;
+
+    if ( sat == NULL ) {
+        return;
+    }
+
+    for ( j = left; j <= GRID_SIZE; j++ ) {
+        sat[0][j] = 0;
+    }
+
+    for ( i = top; i < GRID_SIZE; i++ ) {
+        sat[i+1][0] = 0;
+        for ( j = left; j < GRID_SIZE; j++ ) {
+            sat[i+1][j+1] = sat[i][j+1] + sat[i+1][j] - sat[i][j] +
+                            ( wm->grid[i][j] == TILE_UNKNOWN );
+        }
+    }
+}
+
 struct WorldModel* wm_create(char view[VIEW_SIZE][VIEW_SIZE]) {
     // Malloc the structure we need
     struct WorldModel* wm = malloc(sizeof(struct WorldModel));
@@ -136,32 +183,52 @@ struct WorldModel* wm_create(char view[VIEW_SIZE][VIEW_SIZE]) {
     wm->grid[HOME_POS][HOME_POS] = TILE_HOME;
     wm->been[HOME_POS][HOME_POS] = true;
 
+    wm->unknown_sat = malloc(sizeof(int[GRID_SIZE + 1][GRID_SIZE + 1]));
+    if ( wm->unknown_sat == NULL ) {
+        fprintf(stderr, "No memory for wm_create!\n");
+        free(wm);
+        return NULL;
+    }
+    wm_update_unknown_sat(wm, 0, 0);
+
+    wm->pois = poi_graph_create(wm);
+    if ( wm->pois == NULL ) {
+        fprintf(stderr, "No memory for wm_create!\n");
+        free(wm->unknown_sat);
+        free(wm);
+        return NULL;
+    }
+
+    wm->seen = malloc(sizeof(char[GRID_SIZE][GRID_SIZE]));
+    if ( wm->seen == NULL ) {
+        fprintf(stderr, "No memory for wm_create!\n");
+        poi_graph_destroy(wm->pois);
+        free(wm->unknown_sat);
+        free(wm);
+        return NULL;
+    }
+    memcpy(wm->seen, wm->grid, sizeof(wm->grid));
+
     return wm;
 }
 
 void wm_destroy(struct WorldModel* wm) {
-    // possibly need to do more freeing when we add
-    // new data to the WorldModel struct
+    if ( wm == NULL ) {
+        return;
+    }
+
+    free(wm->unknown_sat);
+    poi_graph_destroy(wm->pois);
+    free(wm->seen);
     free(wm);
 }
 
-struct WorldModel* wm_copy(struct WorldModel* wm) {
-    // Malloc the structure we need
-    struct WorldModel* new_wm = malloc(sizeof(struct WorldModel));
-
-    if ( new_wm == NULL ) {
-        fprintf(stderr, "No memory for wm_copy!\n");
-        return NULL;
-    }
-
+// Copy a world model into one we already have. Copies never keep the
+// structures only the world model made by wm_create has.
+static void wm_copy_into(struct WorldModel* new_wm, struct WorldModel* wm) {
     // Copy the grid
-    int i, j;
-    for ( i = 0; i < GRID_SIZE; i++ ) {
-        for ( j = 0; j < GRID_SIZE; j++ ) {
-            new_wm->grid[i][j] = wm->grid[i][j];
-            new_wm->been[i][j] = wm->been[i][j];
-        }
-    }
+    memcpy(new_wm->grid, wm->grid, sizeof(wm->grid));
+    memcpy(new_wm->been, wm->been, sizeof(wm->been));
 
     // Copy the rest
     new_wm->treasure = wm->treasure;
@@ -172,6 +239,23 @@ struct WorldModel* wm_copy(struct WorldModel* wm) {
     new_wm->raft     = wm->raft;
     new_wm->stones   = wm->stones;
 
+    // Searches don't reveal tiles, so copies count unknowns directly
+    new_wm->unknown_sat = NULL;
+    new_wm->pois = NULL;
+    new_wm->seen = NULL;
+}
+
+struct WorldModel* wm_copy(struct WorldModel* wm) {
+    // Malloc the structure we need
+    struct WorldModel* new_wm = malloc(sizeof(struct WorldModel));
+
+    if ( new_wm == NULL ) {
+        fprintf(stderr, "No memory for wm_copy!\n");
+        return NULL;
+    }
+
+    wm_copy_into(new_wm, wm);
+
     return new_wm;
 }
 
@@ -206,7 +290,7 @@ void wm_take_action(struct WorldModel* wm, char action) {
                     // If we are just enetering the water, use a stone
                     // or the raft
                     if ( wm_get_tile(wm, wm->pos) != TILE_WATER ) {
-                        if ( wm->stones >= 0 ) {
+                        if ( wm->stones > 0 ) {
                             wm->stones--;
                             wm_set_tile(wm, forward_pos, TILE_USED_STONE);
                         } else if ( wm->raft ) {
@@ -283,11 +367,14 @@ void wm_take_action(struct WorldModel* wm, char action) {
     }
 }
 
-void wm_update_view(struct WorldModel* wm, char view[VIEW_SIZE][VIEW_SIZE]) {
+// Returns the number of tiles the view revealed
+int wm_update_view(struct WorldModel* wm, char view[VIEW_SIZE][VIEW_SIZE]) {
     int i, j;
     struct Pos cur_pos;
     char view_tile;
     char grid_tile;
+    int revealed = 0;
+    int top = GRID_SIZE, left = GRID_SIZE;
 
     for ( i = -VIEW_DIST; i <= VIEW_DIST; i++ ) {
         for ( j = -VIEW_DIST; j <= VIEW_DIST; j++ ) {
@@ -300,11 +387,28 @@ void wm_update_view(struct WorldModel* wm, char view[VIEW_SIZE][VIEW_SIZE]) {
             view_tile = view[i+VIEW_DIST][j+VIEW_DIST];
             grid_tile = wm_get_tile(wm, cur_pos);
 
-            if ( grid_tile == TILE_UNKNOWN ) {
+            if ( wm_get_seen_tile(wm, cur_pos) != TILE_UNKNOWN ) {
+                continue;
+            }
+            if ( wm->seen != NULL ) {
+                wm->seen[cur_pos.y][cur_pos.x] = view_tile;
+            }
+
+            // A tile we assumed only changes if we assumed wrong
+            if ( grid_tile != view_tile ) {
                 wm_set_tile(wm, cur_pos, view_tile);
+                revealed++;
+                if ( cur_pos.y < top )  top = cur_pos.y;
+                if ( cur_pos.x < left ) left = cur_pos.x;
             }
         }
     }
+
+    if ( revealed > 0 ) {
+        wm_update_unknown_sat(wm, top, left);
+    }
+
+    return revealed;
 }
 
 char wm_get_tile(struct WorldModel* wm, struct Pos pos) {
@@ -313,6 +417,55 @@ char wm_get_tile(struct WorldModel* wm, struct Pos pos) {
 
 void wm_set_tile(struct WorldModel* wm, struct Pos pos, char tile_val) {
     wm->grid[pos.y][pos.x] = tile_val;
+
+    if ( wm->pois != NULL ) {
+        poi_graph_tile_changed(wm, pos);
+    }
+}
+
+// The tile as we first saw it
+char wm_get_seen_tile(struct WorldModel* wm, struct Pos pos) {
+    if ( wm->seen == NULL ) {
+        return wm->grid[pos.y][pos.x];
+    }
+    return wm->seen[pos.y][pos.x];
+}
+
+void wm_assume_tiles(struct WorldModel* wm, int left, int top, int width, int height, char* tiles) {
+    int x, y;
+
+    if ( wm->seen == NULL ) {
+        return;
+    }
+
+    for ( y = 0; y < height; y++ ) {
+        for ( x = 0; x < width; x++ ) {
+            struct Pos pos = pos_set(left + x, top + y);
+            char tile = tiles[y * width + x];
+            if ( tile != TILE_UNKNOWN && wm->seen[pos.y][pos.x] == TILE_UNKNOWN &&
+                 wm_get_tile(wm, pos) != tile ) {
+                wm_set_tile(wm, pos, tile);
+            }
+        }
+    }
+    wm_update_unknown_sat(wm, top, left);
+}
+
+void wm_forget_assumed(struct WorldModel* wm) {
+    int x, y;
+
+    if ( wm->seen == NULL ) {
+        return;
+    }
+
+    for ( y = 0; y < GRID_SIZE; y++ ) {
+        for ( x = 0; x < GRID_SIZE; x++ ) {
+            if ( wm->seen[y][x] == TILE_UNKNOWN && wm->grid[y][x] != TILE_UNKNOWN ) {
+                wm_set_tile(wm, pos_set(x, y), TILE_UNKNOWN);
+            }
+        }
+    }
+    wm_update_unknown_sat(wm, 0, 0);
 }
 
 void wm_set_been(struct WorldModel* wm, struct Pos pos) {
@@ -323,6 +476,33 @@ bool wm_get_been(struct WorldModel* wm, struct Pos pos) {
     return wm->been[pos.y][pos.x];
 }
 
+// Count the unknown tiles within dist of pos (inclusive), clipped to the grid
+int wm_count_unknown(struct WorldModel* wm, struct Pos pos, int dist) {
+    int y0 = pos.y - dist, y1 = pos.y + dist + 1;
+    int x0 = pos.x - dist, x1 = pos.x + dist + 1;
+    int i, j, count;
+
+    if ( y0 < 0 ) y0 = 0;
+    if ( x0 < 0 ) x0 = 0;
+    if ( y1 > GRID_SIZE ) y1 = GRID_SIZE;
+    if ( x1 > GRID_SIZE ) x1 = GRID_SIZE;
+
+    if ( wm->unknown_sat != NULL ) {
+        return wm->unknown_sat[y1][x1] - wm->unknown_sat[y0][x1]
+             - wm->unknown_sat[y1][x0] + wm->unknown_sat[y0][x0];
+    }
+
+    count = 0;
+    for ( i = y0; i < y1; i++ ) {
+        for ( j = x0; j < x1; j++ ) {
+            if ( wm->grid[i][j] == TILE_UNKNOWN ) {
+                count++;
+            }
+        }
+    }
+    return count;
+}
+
 void wm_print(struct WorldModel* wm) {
     int i, j;
     char c;
@@ -340,188 +520,580 @@ void wm_print(struct WorldModel* wm) {
 
 
 
-// DFS
-bool wm_dfs(struct WorldModel* old_wm, struct Pos cur_pos, Goal goal, int new_req,
-         bool seen[GRID_SIZE][GRID_SIZE], int depth_limit, char* actions) {
-    
-    bool saved_seen[GRID_SIZE][GRID_SIZE];
-    bool need_to_restore_seen = false;
+// Make the turns, chop or unlock needed to step from wm->pos onto the
+// adjacent tile pos, applying them to wm and writing them into actions.
+// Returns a pointer just past the last action written.
+static char* wm_step_to(struct WorldModel* wm, struct Pos pos, char* actions) {
+    // Make all the required turns to move into pos
+    // If we are already facing it this won't make any turns
+    if ( pos_equal(pos, pos_forward_rel(wm->pos, 1, dir_turn_left(wm->dir))) ) {
+        actions[0] = ACTION_LEFT;
+        actions++;
+        wm_take_action(wm, ACTION_LEFT);
+    } else if ( pos_equal(pos, pos_forward_rel(wm->pos, 1, dir_turn_right(wm->dir))) ) {
+        actions[0] = ACTION_RIGHT;
+        actions++;
+        wm_take_action(wm, ACTION_RIGHT);
+    } else if ( pos_equal(pos, pos_forward_rel(wm->pos, -1, wm->dir)) ) {
+        actions[0] = ACTION_LEFT;
+        actions++;
+        actions[0] = ACTION_LEFT;
+        actions++;
+        wm_take_action(wm, ACTION_LEFT);
+        wm_take_action(wm, ACTION_LEFT);
+    }
+
+    // If we need a chop or unlock action then take it
+    if ( wm_get_tile(wm, pos) == TILE_TREE ) {
+        actions[0] = ACTION_CHOP;
+        actions++;
+        wm_take_action(wm, ACTION_CHOP);
+    } else if ( wm_get_tile(wm, pos) == TILE_DOOR ) {
+        actions[0] = ACTION_UNLOCK;
+        actions++;
+        wm_take_action(wm, ACTION_UNLOCK);
+    } 
+
+    // Finally make the forward move
+    actions[0] = ACTION_FORWARD;
+    actions++;
+    wm_take_action(wm, ACTION_FORWARD);
+
+    return actions;
+}
+
+
+// Tiles we can cross on the way home without using up a stone or the raft
+static bool wm_home_passable(struct WorldModel* wm, struct Pos pos) {
+    switch(wm_get_tile(wm, pos)) {
+        case TILE_HOME:
+        case TILE_LAND:
+        case TILE_USED_STONE:
+        case TILE_AXE:
+        case TILE_KEY:
+        case TILE_STONE:
+            return true;
+        case TILE_TREE:
+            return wm->axe;
+        case TILE_DOOR:
+            return wm->key;
+        default:
+            return false;
+    }
+}
+
+// Binary heap on f, for the cheapest-first searches below
+struct HeapNode {
+    int f;
+    int g;
+    struct Pos pos;
+    Direction dir;   // for searches over facings, otherwise -1
+};
+
+static void heap_push(struct HeapNode* heap, int* size, struct HeapNode node) {
+    int i = (*size)++;
+    while ( i > 0 && heap[(i - 1) / 2].f > node.f ) {
+        heap[i] = heap[(i - 1) / 2];
+        i = (i - 1) / 2;
+    }
+    heap[i] = node;
+}
+
+static struct HeapNode heap_pop(struct HeapNode* heap, int* size) {
+    struct HeapNode top = heap[0];
+    struct HeapNode last = heap[--(*size)];
+    int i = 0;
+
+    while ( 2*i + 1 < *size ) {
+        int child = 2*i + 1;
+        if ( child + 1 < *size && heap[child + 1].f < heap[child].f ) {
+            child++;
+        }
+        if ( last.f <= heap[child].f ) {
+            break;
+        }
+        heap[i] = heap[child];
+        i = child;
+    }
+    heap[i] = last;
+
+    return top;
+}
 
-    //fprintf(stderr, "Begin: (%d,%d)", cur_pos.y, cur_pos.x);
+// Trips home
+// Once a winning plan holds the treasure it can head straight home, down
+// a tree that a breadth first search out from home builds over the tiles
+// we can cross without using up a stone or the raft. Each tile the tree
+// reaches holds the direction of the next step home. Which tiles those
+// are only depends on whether we hold the axe and the key, so a search
+// keeps a tree for each and builds it the first time it's needed. Once
+// the search has put stones down they could open up other ways home, so
+// it builds a fresh tree every time instead.
+#define HOME_TREES       4      // one for each of axe and key, held or not
+#define HOME_TREE_ONCE   HOME_TREES
+#define HOME_HERE        4
+#define HOME_UNREACHED   0xff
+
+static void wm_home_tree(struct WorldModel* wm, unsigned char (*toward)[GRID_SIZE], struct Pos* queue) {
+    int head = 0, tail = 0;
+    Direction dir;
+
+    memset(toward, HOME_UNREACHED, sizeof(unsigned char[GRID_SIZE][GRID_SIZE]));
+
+    struct Pos home = pos_set(HOME_POS, HOME_POS);
+    toward[home.y][home.x] = HOME_HERE;
+    queue[tail++] = home;
+
+    while ( head < tail ) {
+        struct Pos cur = queue[head++];
 
-    if ( seen != NULL ) {
-        seen[cur_pos.y][cur_pos.x] = true;
+        for ( dir = DIRECTION_UP; dir <= DIRECTION_RIGHT; dir++ ) {
+            struct Pos next = pos_forward_rel(cur, 1, dir);
+
+            if ( next.x < 0 || next.x >= GRID_SIZE || next.y < 0 || next.y >= GRID_SIZE ||
+                 toward[next.y][next.x] != HOME_UNREACHED || !wm_home_passable(wm, next) ) {
+                continue;
+            }
+
+            toward[next.y][next.x] = dir_turn_right(dir_turn_right(dir));
+            queue[tail++] = next;
+        }
     }
+}
+
+// Walk the agent home down the tree, applying the moves to wm and writing
+// them into actions. Returns false if the tree doesn't reach the agent, or
+// the trip would take more than MAX_HOME_STEPS steps.
+static bool wm_walk_home(struct WorldModel* wm, unsigned char (*toward)[GRID_SIZE], char* actions) {
+    struct Pos home = pos_set(HOME_POS, HOME_POS);
+    int steps = 0;
 
-    // Check if the tile is permissible with respect to the goal
-    if ( !wm_walk_test_permissible(old_wm, cur_pos, goal) ) {
+    if ( toward[wm->pos.y][wm->pos.x] == HOME_UNREACHED ) {
         return false;
     }
 
-    struct WorldModel* wm = wm_copy(old_wm);
-    if ( wm == NULL ) {
-        fprintf( stderr, "DFS out of memory!\n" );
+    while ( !pos_equal(wm->pos, home) ) {
+        if ( steps++ == MAX_HOME_STEPS ) {
+            return false;
+        }
+        actions = wm_step_to(wm, pos_forward_rel(wm->pos, 1, toward[wm->pos.y][wm->pos.x]), actions);
+    }
+    actions[0] = '\0';
+
+    return true;
+}
+
+// One tile on the path the search is trying. Holds what we need to carry
+// on with the tile's neighbours, and to undo stepping onto it.
+struct DfsFrame {
+    struct Pos pos;
+    GoalMask mask;
+    int new_tiles;
+    int depth_limit;
+
+    // End of the path once we've stepped onto the tile
+    char* actions;
+
+    // The agent and the tile as they were before we stepped onto it.
+    // Stepping onto a tile only ever changes that tile.
+    struct Pos old_pos;
+    Direction old_dir;
+    bool old_treasure;
+    bool old_key;
+    bool old_axe;
+    bool old_raft;
+    int old_stones;
+    char old_tile;
+    bool old_been;
+
+    // Whether we put a stone down stepping onto the tile
+    bool placed_stone;
+
+    // Whether the seen array was saved on entering the tile
+    bool saved;
+
+    // Neighbours in the order we try them, and the next one to try
+    struct Pos next[4];
+    int next_i;
+};
+
+// Search arena
+// Everything one wm_plan call needs, so peak memory is
+// sizeof(struct PlanArena) however the search goes. The search moves a
+// single world model around, undoing each step as it backs out, and a
+// frame on a tile that can change the search saves the seen array into
+// its own slot. Arenas are kept for the next call once a search is done,
+// so there are only ever as many as there have been searches running
+// at once, and nothing is allocated while planning.
+struct PlanArena {
+    struct WorldModel wm;
+    struct DfsFrame frames[MAX_DEPTH + 1];
+    GoalMask seen[GRID_SIZE][GRID_SIZE];
+    GoalMask saved_seen[MAX_DEPTH + 1][GRID_SIZE][GRID_SIZE];
+    char path[MAX_PLAN_LEN];
+
+    // Trips home, with a slot for trees that are only used once
+    struct WorldModel home_wm;
+    unsigned char home_trees[HOME_TREES + 1][GRID_SIZE][GRID_SIZE];
+    struct Pos home_queue[(GRID_SIZE) * (GRID_SIZE)];
+    char home_path[MAX_HOME_LEN];
+
+    struct PlanArena* next;        // next arena not in use
+};
+
+static pthread_mutex_t plan_arena_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct PlanArena* plan_arenas = NULL;
+
+// An arena no other search is using
+static struct PlanArena* plan_arena_take(void) {
+    pthread_mutex_lock(&plan_arena_lock);
+    struct PlanArena* arena = plan_arenas;
+    if ( arena != NULL ) {
+        plan_arenas = arena->next;
+    }
+    pthread_mutex_unlock(&plan_arena_lock);
+
+    if ( arena == NULL ) {
+        arena = malloc(sizeof(struct PlanArena));
+    }
+    return arena;
+}
+
+static void plan_arena_give(struct PlanArena* arena) {
+    pthread_mutex_lock(&plan_arena_lock);
+    arena->next = plan_arenas;
+    plan_arenas = arena;
+    pthread_mutex_unlock(&plan_arena_lock);
+}
+
+// State shared by every frame of one multi-goal search
+struct PlanSearch {
+    struct Plan* plans;
+    int n_plans;
+
+    // Goals we still need to find. A goal drops out once it has been
+    // found, or once a higher priority goal has been found.
+    GoalMask active;
+
+    // Per tile, the goals whose search has already visited the tile
+    GoalMask (*seen)[GRID_SIZE];
+
+    // Start of the action buffer shared by all frames
+    char* path;
+
+    // Which trees home have been built, and how many stones the path
+    // being tried has put down
+    bool home_built[HOME_TREES];
+    int stones_placed;
+
+    struct PlanArena* arena;
+};
+
+// Record the path so far as the plan for goal i, followed by the trip
+// home if there is one
+static void wm_plan_record(struct PlanSearch* search, int i, char* actions, char* home) {
+    actions[0] = '\0';
+    strcpy(search->plans[i].actions, search->path);
+    strcpy(search->plans[i].home_actions, home != NULL ? home : "");
+    search->plans[i].found = true;
+
+    // Nothing below this goal in priority is worth finding any more
+    search->active &= ((GoalMask)1 << i) - 1;
+}
+
+// The tree home for the items held in wm
+static unsigned char (*wm_plan_home_tree(struct PlanSearch* search, struct WorldModel* wm))[GRID_SIZE] {
+    struct PlanArena* arena = search->arena;
+    int held = ( wm->axe ? 1 : 0 ) | ( wm->key ? 2 : 0 );
+
+    if ( search->stones_placed > 0 ) {
+        wm_home_tree(wm, arena->home_trees[HOME_TREE_ONCE], arena->home_queue);
+        return arena->home_trees[HOME_TREE_ONCE];
+    }
+
+    if ( !search->home_built[held] ) {
+        wm_home_tree(wm, arena->home_trees[held], arena->home_queue);
+        search->home_built[held] = true;
+    }
+    return arena->home_trees[held];
+}
+
+// Step onto the frame's tile and test it for goals. Returns false, having
+// changed nothing but seen, if none of the frame's goals can go there.
+// Sets done once there are no goals left to search for.
+static bool wm_dfs_enter(struct PlanSearch* search, int level, bool* done) {
+    struct PlanArena* arena = search->arena;
+    struct WorldModel* wm = &arena->wm;
+    struct DfsFrame* frame = &arena->frames[level];
+    GoalMask (*seen)[GRID_SIZE] = search->seen;
+    struct Pos cur_pos = frame->pos;
+    int i;
+
+    frame->mask &= search->active;
+    seen[cur_pos.y][cur_pos.x] |= frame->mask;
+
+    // Drop the goals the tile is not permissible for. Many plans share a
+    // goal type, so only test each type once.
+    GoalMask tested = 0;
+    for ( i = 0; i < search->n_plans; i++ ) {
+        if ( (frame->mask & ~tested & ((GoalMask)1 << i)) ) {
+            Goal goal = search->plans[i].goal;
+            bool permissible = wm_walk_test_permissible(wm, cur_pos, goal);
+            int j;
+            for ( j = i; j < search->n_plans; j++ ) {
+                if ( search->plans[j].goal == goal ) {
+                    tested |= (GoalMask)1 << j;
+                    if ( !permissible ) {
+                        frame->mask &= ~((GoalMask)1 << j);
+                    }
+                }
+            }
+        }
+    }
+
+    if ( frame->mask == 0 ) {
         return false;
     }
 
-    if ( !pos_equal(cur_pos, wm->pos) ) {
-        // Make all the required turns to move into cur_pos
-        // If we are already there this won't make any turns
-        if ( pos_equal(cur_pos, pos_forward_rel(wm->pos, 1, dir_turn_left(wm->dir))) ) {
-            actions[0] = ACTION_LEFT;
-            actions++;
-            wm_take_action(wm, ACTION_LEFT);
-        } else if ( pos_equal(cur_pos, pos_forward_rel(wm->pos, 1, dir_turn_right(wm->dir))) ) {
-            actions[0] = ACTION_RIGHT;
-            actions++;
-            wm_take_action(wm, ACTION_RIGHT);
-        } else if ( pos_equal(cur_pos, pos_forward_rel(wm->pos, -1, wm->dir)) ) {
-            actions[0] = ACTION_LEFT;
-            actions++;
-            actions[0] = ACTION_LEFT;
-            actions++;
-            wm_take_action(wm, ACTION_LEFT);
-            wm_take_action(wm, ACTION_LEFT);
-        }
-
-        // If we need a chop or unlock action then take it
-        if ( wm_get_tile(wm, cur_pos) == TILE_TREE ) {
-            actions[0] = ACTION_CHOP;
-            actions++;
-            wm_take_action(wm, ACTION_CHOP);
-        } else if ( wm_get_tile(wm, cur_pos) == TILE_DOOR ) {
-            actions[0] = ACTION_UNLOCK;
-            actions++;
-            wm_take_action(wm, ACTION_UNLOCK);
-        } 
-
-        // Finally make the forward move
-        actions[0] = ACTION_FORWARD;
-        actions++;
-        wm_take_action(wm, ACTION_FORWARD);
+    frame->old_pos      = wm->pos;
+    frame->old_dir      = wm->dir;
+    frame->old_treasure = wm->treasure;
+    frame->old_key      = wm->key;
+    frame->old_axe      = wm->axe;
+    frame->old_raft     = wm->raft;
+    frame->old_stones   = wm->stones;
+    frame->old_tile     = wm_get_tile(wm, cur_pos);
+    frame->old_been     = wm_get_been(wm, cur_pos);
+    frame->placed_stone = false;
+    frame->saved        = false;
+    frame->next_i       = 4;
+
+    bool moved = !pos_equal(cur_pos, wm->pos);
+
+    if ( moved ) {
+        frame->actions = wm_step_to(wm, cur_pos, frame->actions);
+
+        if ( frame->old_tile == TILE_WATER && wm_get_tile(wm, cur_pos) == TILE_USED_STONE ) {
+            frame->placed_stone = true;
+            search->stones_placed++;
+        }
 
-        // If we havent been to this tile before, update new_req
-        if ( !wm_get_been(old_wm, cur_pos) ) {
-            new_req--;
+        // If we havent been to this tile before, count it as new
+        if ( !frame->old_been ) {
+            frame->new_tiles++;
         }
-    
-    } 
-    
-    char old_tile = wm_get_tile(old_wm, cur_pos);
+    }
 
-    // Test if we have found the goal
-    if ( wm_walk_test_goal(wm, goal, old_tile, new_req) ) {
-        // We are at the goal, so we don't need
-        // any more actions.
-        //fprintf(stderr, "Goal: (%d,%d)\n", cur_pos.y, cur_pos.x);
-        actions[0] = '\0';
-        wm_destroy(wm);
+    char old_tile = frame->old_tile;
+
+    // Test if we have found any of the goals
+    for ( i = 0; i < search->n_plans; i++ ) {
+        struct Plan* plan = &search->plans[i];
+        if ( (frame->mask & ((GoalMask)1 << i)) &&
+             wm_walk_test_goal(wm, plan->goal, old_tile, plan->new_req - frame->new_tiles) ) {
+            wm_plan_record(search, i, frame->actions, NULL);
+        } else if ( (frame->mask & ((GoalMask)1 << i)) && plan->goal == GOAL_WIN &&
+                    wm->treasure && (old_tile == TILE_TREASURE || !moved) ) {
+            // We hold the treasure, so head straight home if the tree
+            // home reaches us. The trip home doesn't count against the
+            // depth limit.
+            unsigned char (*toward)[GRID_SIZE] = wm_plan_home_tree(search, wm);
+            if ( toward[cur_pos.y][cur_pos.x] != HOME_UNREACHED ) {
+                wm_copy_into(&arena->home_wm, wm);
+                if ( wm_walk_home(&arena->home_wm, toward, arena->home_path) ) {
+                    wm_plan_record(search, i, frame->actions, arena->home_path);
+                }
+            }
+        }
+    }
+
+    frame->mask &= search->active;
+
+    if ( search->active == 0 ) {
+        *done = true;
         return true;
-    } 
+    }
 
-    // If we reached the depth limit, don't try any more tiles.
-    if ( depth_limit == 0 ) {
-        wm_destroy(wm);
-        return false;
+    // If we reached the depth limit or have nothing left to look for here,
+    // don't try any more tiles.
+    if ( frame->depth_limit == 0 || frame->mask == 0 ) {
+        return true;
     }
 
-    depth_limit--;
+    frame->depth_limit--;
 
     // Now if we hit an obstacle or picked up an object we need to save the old seen
-    // array and clear it. We restore it at the end of the function
+    // array and clear it for our goals. We restore it when we leave the tile
     if ( old_tile == TILE_KEY ||
          old_tile == TILE_TREE ||
          old_tile == TILE_DOOR ||
          old_tile == TILE_AXE ||
-         old_tile == TILE_KEY ||
          old_tile == TILE_STONE ||
          old_tile == TILE_TREASURE ) {
 
-        // save and clear seen
-        int i, j;
+        GoalMask (*saved_seen)[GRID_SIZE] = arena->saved_seen[level];
+        int j;
         for( i = 0; i < GRID_SIZE; i++ ) {
             for ( j = 0; j < GRID_SIZE; j++ ) {
                 saved_seen[i][j] = seen[i][j];
-                seen[i][j] = false;
+                seen[i][j] &= ~frame->mask;
             }
         }
-
-        need_to_restore_seen = true;
+        frame->saved = true;
 
         // set the current position to seen
-        seen[cur_pos.y][cur_pos.x] = true;
+        seen[cur_pos.y][cur_pos.x] |= frame->mask;
     }
 
-    
-    // Mark adjacent tiles as seen
-    struct Pos pos_f = pos_forward_rel(cur_pos, 1, wm->dir);
-    struct Pos pos_r = pos_forward_rel(cur_pos, 1, dir_turn_right(wm->dir));
-    struct Pos pos_l = pos_forward_rel(cur_pos, 1, dir_turn_left(wm->dir));
-    struct Pos pos_b = pos_forward_rel(cur_pos, -1, wm->dir);
-
-    // Test Walking forward
-    if ( !seen[pos_f.y][pos_f.x] ) {
-        //fprintf(stderr, "Add: (%d,%d)", pos_f.y, pos_f.x);
-        if ( wm_dfs(wm, pos_f, goal, new_req, seen, depth_limit, actions) ) {
-            wm_destroy(wm);
-            return true;
-        }
+    // Try walking forward, right, left then backward
+    frame->next[0] = pos_forward_rel(cur_pos, 1, wm->dir);
+    frame->next[1] = pos_forward_rel(cur_pos, 1, dir_turn_right(wm->dir));
+    frame->next[2] = pos_forward_rel(cur_pos, 1, dir_turn_left(wm->dir));
+    frame->next[3] = pos_forward_rel(cur_pos, -1, wm->dir);
+    frame->next_i = 0;
+
+    return true;
+}
+
+// Step back off the frame's tile
+static void wm_dfs_leave(struct PlanSearch* search, int level, bool done) {
+    struct PlanArena* arena = search->arena;
+    struct WorldModel* wm = &arena->wm;
+    struct DfsFrame* frame = &arena->frames[level];
+
+    wm->grid[frame->pos.y][frame->pos.x] = frame->old_tile;
+    wm->been[frame->pos.y][frame->pos.x] = frame->old_been;
+    wm->pos      = frame->old_pos;
+    wm->dir      = frame->old_dir;
+    wm->treasure = frame->old_treasure;
+    wm->key      = frame->old_key;
+    wm->axe      = frame->old_axe;
+    wm->raft     = frame->old_raft;
+    wm->stones   = frame->old_stones;
+
+    if ( frame->placed_stone ) {
+        search->stones_placed--;
     }
 
-    // Test walking right
-    if ( !seen[pos_r.y][pos_r.x] ) {
-        //fprintf(stderr, "Add: (%d,%d)", pos_r.y, pos_r.x);
-        if ( wm_dfs(wm, pos_r, goal, new_req, seen, depth_limit, actions) ) {
-            wm_destroy(wm);
-            return true;
-        }
+    // Restore seen to its old value
+    if ( frame->saved && !done ) {
+        memcpy(search->seen, arena->saved_seen[level], sizeof(GoalMask[GRID_SIZE][GRID_SIZE]));
     }
+}
 
-    // Test walking left
-    if ( !seen[pos_l.y][pos_l.x] ) {
-        //fprintf(stderr, "Add: (%d,%d)", pos_l.y, pos_l.x);
-        if ( wm_dfs(wm, pos_l, goal, new_req, seen, depth_limit, actions) ) {
-            wm_destroy(wm);
-            return true;
-        }
+// DFS
+// Searches for every goal at once, from the arena's world model out to
+// depth_limit steps. Each goal keeps its own bit in the seen array, so
+// the tiles it visits are exactly the ones a search for that goal alone
+// would visit, but moves along shared paths are only made once. The path
+// being tried is a stack of frames, one per tile.
+// Returns true when there are no goals left to search for.
+static bool wm_dfs(struct PlanSearch* search, int depth_limit) {
+    struct PlanArena* arena = search->arena;
+    struct DfsFrame* frames = arena->frames;
+    bool done = false;
+    int top = 0;
+
+    frames[0].pos         = arena->wm.pos;
+    frames[0].mask        = search->active;
+    frames[0].new_tiles   = 0;
+    frames[0].depth_limit = depth_limit;
+    frames[0].actions     = search->path;
+
+    if ( !wm_dfs_enter(search, 0, &done) ) {
+        return false;
     }
 
-    // Test walking backward
-    if ( !seen[pos_b.y][pos_b.x] ) {
-        //fprintf(stderr, "Add: (%d,%d)", pos_b.y, pos_b.x);
-        if ( wm_dfs(wm, pos_b, goal, new_req, seen, depth_limit, actions) ) {
-            wm_destroy(wm);
-            return true;
+    while ( top >= 0 ) {
+        struct DfsFrame* frame = &frames[top];
+
+        // Try the next neighbour we still have goals to look for on
+        if ( !done && frame->next_i < 4 ) {
+            struct Pos next = frame->next[frame->next_i++];
+            GoalMask next_mask = frame->mask & search->active & ~search->seen[next.y][next.x];
+            if ( next_mask != 0 ) {
+                struct DfsFrame* child = &frames[top + 1];
+                child->pos         = next;
+                child->mask        = next_mask;
+                child->new_tiles   = frame->new_tiles;
+                child->depth_limit = frame->depth_limit;
+                child->actions     = frame->actions;
+                if ( wm_dfs_enter(search, top + 1, &done) ) {
+                    top++;
+                }
+            }
+            continue;
         }
+
+        wm_dfs_leave(search, top, done);
+        top--;
     }
 
-    wm_destroy(wm);
+    return done;
+}
 
-    // Restore seen to its old value
-    if ( need_to_restore_seen ) {
-        int i, j;
-        for( i = 0; i < GRID_SIZE; i++ ) {
-            for ( j = 0; j < GRID_SIZE; j++ ) {
-                seen[i][j] = saved_seen[i][j];
-            }
+int wm_plan(struct WorldModel* wm, struct Plan* plans, int n_plans) {
+    struct PlanSearch search;
+    int i, depth;
+
+    assert(n_plans <= MAX_PLANS);
+
+    for ( i = 0; i < n_plans; i++ ) {
+        plans[i].found = false;
+        plans[i].actions[0] = '\0';
+        plans[i].home_actions[0] = '\0';
+    }
+
+    search.arena = plan_arena_take();
+    if ( search.arena == NULL ) {
+        fprintf( stderr, "No memory for wm_plan!\n" );
+        return -1;
+    }
+
+    search.plans   = plans;
+    search.n_plans = n_plans;
+    search.active  = (GoalMask)(((unsigned int)1 << n_plans) - 1);
+    search.path    = search.arena->path;
+    search.seen    = search.arena->seen;
+    search.stones_placed = 0;
+    memset(search.home_built, 0, sizeof(search.home_built));
+
+    // Every step is undone on the way back, so the one copy does for
+    // every depth
+    wm_copy_into(&search.arena->wm, wm);
+
+    for( depth = 1; depth <= MAX_DEPTH && search.active != 0; depth++ ) {
+        memset(search.seen, 0, sizeof(GoalMask[GRID_SIZE][GRID_SIZE]));
+        wm_dfs(&search, depth);
+    }
+
+    plan_arena_give(search.arena);
+
+    // Return the highest priority goal we found
+    for ( i = 0; i < n_plans; i++ ) {
+        if ( plans[i].found ) {
+            return i;
         }
     }
-    
-    return false;
+
+    return -1;
+}
+
+void wm_plan_path(struct Plan* plan, char* actions) {
+    strcpy(actions, plan->actions);
+    strcat(actions, plan->home_actions);
 }
 
 bool wm_walk(struct WorldModel* wm, char* actions, Goal goal, int new_req) {
-    int depth;
-    for( depth = 1; depth < 50; depth++ ) {
-        bool seen[GRID_SIZE][GRID_SIZE] = {{0}};
-        if ( wm_dfs(wm, wm->pos, goal, new_req, seen, depth, actions) ) {
-            return true;
-        }
-    }
+    struct Plan plan;
 
-    actions[0] = '\0';
+    plan.goal    = goal;
+    plan.new_req = new_req;
 
-    return false;
+    bool found = ( wm_plan(wm, &plan, 1) == 0 );
+    wm_plan_path(&plan, actions);
+
+    return found;
 }
 
  
@@ -611,3 +1183,2264 @@ bool wm_walk_test_goal(struct WorldModel* wm, Goal goal, char old_tile, int new_
     return false;
 }
 
+// Number of (position, direction) states on the grid, and the index of one
+#define N_STATES ((GRID_SIZE) * (GRID_SIZE) * 4)
+
+static int wm_state(struct Pos pos, Direction dir) {
+    return (pos.y * (GRID_SIZE) + pos.x) * 4 + dir;
+}
+
+static struct Pos wm_state_pos(int state) {
+    return pos_set((state / 4) % (GRID_SIZE), (state / 4) / (GRID_SIZE));
+}
+
+// Information gain exploration
+// Breadth first search over (position, direction) states, where every
+// action costs one move. Walking through a door costs the unlock as well,
+// and is recorded as ACTION_UNLOCK. Each tile we can reach is scored by the number
+// of unknown tiles it would show us divided by the moves needed to get
+// there, and we plan the whole way to the best one.
+bool wm_explore(struct WorldModel* wm, char* actions) {
+    int* cost    = malloc(sizeof(int) * N_STATES);
+    int* parent  = malloc(sizeof(int) * N_STATES);
+    char* via    = malloc(sizeof(char) * N_STATES);
+    int* queue   = malloc(sizeof(int) * N_STATES * 3);
+    int i, best = -1;
+    double best_score = 0;
+
+    if ( cost == NULL || parent == NULL || via == NULL || queue == NULL ) {
+        fprintf( stderr, "No memory for wm_explore!\n" );
+        free(cost); free(parent); free(via); free(queue);
+        actions[0] = '\0';
+        return false;
+    }
+
+    // Unlocking a door costs two moves, so states come out of buckets by
+    // cost rather than in the order they went in. Steps cost 1 or 2, so
+    // only three costs are ever waiting and bucket c % 3 holds cost c.
+    // A state goes in again whenever we find a cheaper way to it, and
+    // the entries left behind are skipped.
+    int* bucket[3] = { queue, queue + N_STATES, queue + 2 * N_STATES };
+    int bucket_size[3] = { 0, 0, 0 };
+    int pending = 0, c, k;
+
+    for ( i = 0; i < N_STATES; i++ ) {
+        cost[i] = -1;
+    }
+
+    int start = wm_state(wm->pos, wm->dir);
+    cost[start] = 0;
+    parent[start] = -1;
+    bucket[0][bucket_size[0]++] = start;
+    pending++;
+
+    for ( c = 0; pending > 0; c++ ) {
+        int* cur_bucket = bucket[c % 3];
+        int n = bucket_size[c % 3];
+        bucket_size[c % 3] = 0;
+        pending -= n;
+
+        for ( k = 0; k < n; k++ ) {
+            int cur = cur_bucket[k];
+            if ( cost[cur] != c ) {
+                continue;
+            }
+            Direction dir = cur % 4;
+            struct Pos pos = wm_state_pos(cur);
+
+            // Score the tile when it comes out, since that is the
+            // cheapest way there
+            if ( c > 0 && (via[cur] == ACTION_FORWARD || via[cur] == ACTION_UNLOCK) ) {
+                int gain = wm_count_unknown(wm, pos, VIEW_DIST);
+                double score = (double) gain / c;
+                if ( gain > 0 && score > best_score ) {
+                    best_score = score;
+                    best = cur;
+                }
+            }
+
+            int next[3];
+            char next_action[3] = { ACTION_FORWARD, ACTION_LEFT, ACTION_RIGHT };
+            int next_cost[3] = { 1, 1, 1 };
+            struct Pos forward_pos = pos_forward_rel(pos, 1, dir);
+
+            if ( wm_get_tile(wm, forward_pos) == TILE_DOOR ) {
+                next_action[0] = ACTION_UNLOCK;
+                next_cost[0] = 2;
+            }
+
+            next[0] = wm_walk_test_permissible(wm, forward_pos, GOAL_EXPLORE) ? wm_state(forward_pos, dir) : -1;
+            next[1] = wm_state(pos, dir_turn_left(dir));
+            next[2] = wm_state(pos, dir_turn_right(dir));
+
+            for ( i = 0; i < 3; i++ ) {
+                int next_c = c + next_cost[i];
+                if ( next[i] >= 0 && (cost[next[i]] < 0 || next_c < cost[next[i]]) ) {
+                    cost[next[i]]   = next_c;
+                    parent[next[i]] = cur;
+                    via[next[i]]    = next_action[i];
+                    bucket[next_c % 3][bucket_size[next_c % 3]++] = next[i];
+                    pending++;
+                }
+            }
+        }
+    }
+
+    bool found = ( best >= 0 );
+
+    // Walk back from the best state to write out the actions
+    if ( found ) {
+        int len = cost[best];
+        int cur = best;
+        actions[len] = '\0';
+        while ( cur != start ) {
+            if ( via[cur] == ACTION_UNLOCK ) {
+                actions[--len] = ACTION_FORWARD;
+            }
+            actions[--len] = via[cur];
+            cur = parent[cur];
+        }
+    } else {
+        actions[0] = '\0';
+    }
+
+    free(cost);
+    free(parent);
+    free(via);
+    free(queue);
+
+    return found;
+}
+
+// Check an exploration plan still only crosses tiles exploring may cross,
+// and still ends somewhere that will show us unknown tiles
+bool wm_explore_test_plan(struct WorldModel* wm, char* actions) {
+    if ( actions[0] == '\0' ) {
+        return false;
+    }
+
+    struct WorldModel* plan_wm = wm_copy(wm);
+    if ( plan_wm == NULL ) {
+        return false;
+    }
+
+    bool valid = true;
+    for ( ; *actions != '\0' && valid; actions++ ) {
+        if ( *actions == ACTION_FORWARD &&
+             !wm_walk_test_permissible(plan_wm, pos_forward_rel(plan_wm->pos, 1, plan_wm->dir), GOAL_EXPLORE) ) {
+            valid = false;
+        } else {
+            wm_take_action(plan_wm, *actions);
+        }
+    }
+
+    valid = valid && wm_count_unknown(plan_wm, plan_wm->pos, VIEW_DIST) > 0;
+
+    wm_destroy(plan_wm);
+
+    return valid;
+}
+
+
+// Reachability
+// Each row of the grid is a bitset of REACH_WORDS words, with column x at
+// bit x % 64 of word x / 64. A flood fills whole rows at a time with
+// shifts and masks, pushing what each row reached into the rows above and
+// below, and sweeps down and up the grid until nothing new is reached.
+
+// The kinds of tile the rules choose from, one bitset grid each
+enum ReachKind{ KIND_LAND,       // land, home, used stones and items
+                KIND_WATER,
+                KIND_TREE,
+                KIND_DOOR,
+                KIND_STONE,
+                KIND_UNKNOWN,
+                KIND_NEW,        // tiles we haven't been on
+                KIND_TREASURE,
+                KIND_AXE,
+                KIND_KEY,
+                N_KINDS };
+
+// Which kinds a tile is, one bit per kind
+static int reach_tile_kinds(char tile) {
+    switch ( tile ) {
+        case TILE_TREASURE:   return (1 << KIND_TREASURE) | (1 << KIND_LAND);
+        case TILE_AXE:        return (1 << KIND_AXE) | (1 << KIND_LAND);
+        case TILE_KEY:        return (1 << KIND_KEY) | (1 << KIND_LAND);
+        case TILE_LAND:
+        case TILE_HOME:
+        case TILE_USED_STONE: return 1 << KIND_LAND;
+        case TILE_WATER:      return 1 << KIND_WATER;
+        case TILE_TREE:       return 1 << KIND_TREE;
+        case TILE_DOOR:       return 1 << KIND_DOOR;
+        case TILE_STONE:      return 1 << KIND_STONE;
+        case TILE_UNKNOWN:    return 1 << KIND_UNKNOWN;
+    }
+    return 0;
+}
+
+#ifdef __SSE2__
+// One bit for each of the sixteen tiles that is the given tile
+static inline unsigned long long reach_match(__m128i tiles, char tile) {
+    return (unsigned int)_mm_movemask_epi8(_mm_cmpeq_epi8(tiles, _mm_set1_epi8(tile)));
+}
+#endif
+
+static void wm_reach_kinds(struct WorldModel* wm, struct Reach* kinds) {
+    int x, y, kind;
+
+    memset(kinds, 0, sizeof(struct Reach) * N_KINDS);
+
+    for ( y = 0; y < GRID_SIZE; y++ ) {
+        x = 0;
+#ifdef __SSE2__
+        // Sort sixteen tiles at a time with byte compares. Sixteen divides
+        // a word, so they always land in the same one.
+        for ( ; x + 16 <= GRID_SIZE; x += 16 ) {
+            __m128i tiles = _mm_loadu_si128((__m128i*)&wm->grid[y][x]);
+            __m128i been  = _mm_loadu_si128((__m128i*)&wm->been[y][x]);
+            int w = x / 64, s = x % 64;
+
+            unsigned long long treasure = reach_match(tiles, TILE_TREASURE);
+            unsigned long long axe      = reach_match(tiles, TILE_AXE);
+            unsigned long long key      = reach_match(tiles, TILE_KEY);
+            unsigned long long land     = reach_match(tiles, TILE_LAND) |
+                                          reach_match(tiles, TILE_HOME) |
+                                          reach_match(tiles, TILE_USED_STONE) |
+                                          treasure | axe | key;
+
+            kinds[KIND_LAND].rows[y][w]     |= land << s;
+            kinds[KIND_WATER].rows[y][w]    |= reach_match(tiles, TILE_WATER) << s;
+            kinds[KIND_TREE].rows[y][w]     |= reach_match(tiles, TILE_TREE) << s;
+            kinds[KIND_DOOR].rows[y][w]     |= reach_match(tiles, TILE_DOOR) << s;
+            kinds[KIND_STONE].rows[y][w]    |= reach_match(tiles, TILE_STONE) << s;
+            kinds[KIND_UNKNOWN].rows[y][w]  |= reach_match(tiles, TILE_UNKNOWN) << s;
+            kinds[KIND_NEW].rows[y][w]      |= reach_match(been, false) << s;
+            kinds[KIND_TREASURE].rows[y][w] |= treasure << s;
+            kinds[KIND_AXE].rows[y][w]      |= axe << s;
+            kinds[KIND_KEY].rows[y][w]      |= key << s;
+        }
+#endif
+        for ( ; x < GRID_SIZE; x++ ) {
+            unsigned long long bit = 1ULL << (x % 64);
+            int tile_kinds = reach_tile_kinds(wm->grid[y][x]);
+
+            if ( !wm->been[y][x] ) {
+                tile_kinds |= 1 << KIND_NEW;
+            }
+            for ( kind = 0; kind < N_KINDS; kind++ ) {
+                if ( tile_kinds & (1 << kind) ) {
+                    kinds[kind].rows[y][x / 64] |= bit;
+                }
+            }
+        }
+    }
+}
+
+// The tiles the rules let us cross
+static void reach_passable(struct Reach* kinds, int rules, struct Reach* pass) {
+    int y, w;
+
+    for ( y = 0; y < GRID_SIZE; y++ ) {
+        for ( w = 0; w < REACH_WORDS; w++ ) {
+            unsigned long long bits = 0;
+            if ( rules & REACH_LAND )   bits |= kinds[KIND_LAND].rows[y][w];
+            if ( rules & REACH_WATER )  bits |= kinds[KIND_WATER].rows[y][w];
+            if ( rules & REACH_TREES )  bits |= kinds[KIND_TREE].rows[y][w];
+            if ( rules & REACH_DOORS )  bits |= kinds[KIND_DOOR].rows[y][w];
+            if ( rules & REACH_STONES ) bits |= kinds[KIND_STONE].rows[y][w];
+            pass->rows[y][w] = bits;
+        }
+    }
+}
+
+// Shift a row k columns right, or -k columns left if k is negative
+static void reach_shift(const unsigned long long* in, int k, unsigned long long* out) {
+    int q = ( k < 0 ? -k : k ) / 64;
+    int r = ( k < 0 ? -k : k ) % 64;
+    int w;
+
+    for ( w = 0; w < REACH_WORDS; w++ ) {
+        unsigned long long bits = 0;
+        if ( k >= 0 ) {
+            if ( w - q >= 0 )              bits |= in[w - q] << r;
+            if ( r > 0 && w - q - 1 >= 0 ) bits |= in[w - q - 1] >> (64 - r);
+        } else {
+            if ( w + q < REACH_WORDS )              bits |= in[w + q] >> r;
+            if ( r > 0 && w + q + 1 < REACH_WORDS ) bits |= in[w + q + 1] << (64 - r);
+        }
+        out[w] = bits;
+    }
+}
+
+// Spread what a row reached along the runs of passable tiles it touches.
+// Each step doubles how far we look, and the passable masks shrink to the
+// tiles with that many passable tiles before them, so a whole row takes
+// log2(GRID_SIZE) steps each way.
+static void reach_fill_row(unsigned long long* row, const unsigned long long* pass) {
+    unsigned long long right[REACH_WORDS], left[REACH_WORDS];
+    unsigned long long pass_right[REACH_WORDS], pass_left[REACH_WORDS];
+    unsigned long long shifted[REACH_WORDS];
+    int k, w;
+
+    memcpy(right, row, sizeof(right));
+    memcpy(left, row, sizeof(left));
+    memcpy(pass_right, pass, sizeof(pass_right));
+    memcpy(pass_left, pass, sizeof(pass_left));
+
+    for ( k = 1; k < GRID_SIZE; k *= 2 ) {
+        reach_shift(right, k, shifted);
+        for ( w = 0; w < REACH_WORDS; w++ ) right[w] |= shifted[w] & pass_right[w];
+        reach_shift(pass_right, k, shifted);
+        for ( w = 0; w < REACH_WORDS; w++ ) pass_right[w] &= shifted[w];
+
+        reach_shift(left, -k, shifted);
+        for ( w = 0; w < REACH_WORDS; w++ ) left[w] |= shifted[w] & pass_left[w];
+        reach_shift(pass_left, -k, shifted);
+        for ( w = 0; w < REACH_WORDS; w++ ) pass_left[w] &= shifted[w];
+    }
+
+    for ( w = 0; w < REACH_WORDS; w++ ) {
+        row[w] = right[w] | left[w];
+    }
+}
+
+// Carry what row from reached into row y, returning whether that reached
+// anything new
+static bool reach_spread(struct Reach* reach, struct Reach* pass, int y, int from) {
+    unsigned long long seeds[REACH_WORDS], any = 0;
+    int w;
+
+    for ( w = 0; w < REACH_WORDS; w++ ) {
+        seeds[w] = reach->rows[from][w] & pass->rows[y][w] & ~reach->rows[y][w];
+        any |= seeds[w];
+    }
+    if ( any == 0 ) {
+        return false;
+    }
+
+    for ( w = 0; w < REACH_WORDS; w++ ) {
+        reach->rows[y][w] |= seeds[w];
+    }
+    reach_fill_row(reach->rows[y], pass->rows[y]);
+    return true;
+}
+
+// Everything we can walk to from start across passable tiles. We can
+// always leave start, whatever it is.
+static void reach_flood(struct Reach* pass, struct Pos start, struct Reach* reach) {
+    bool grown = true;
+    int y;
+
+    memset(reach, 0, sizeof(struct Reach));
+    reach->rows[start.y][start.x / 64] |= 1ULL << (start.x % 64);
+    reach_fill_row(reach->rows[start.y], pass->rows[start.y]);
+
+    while ( grown ) {
+        grown = false;
+        for ( y = 1; y < GRID_SIZE; y++ ) {
+            grown |= reach_spread(reach, pass, y, y - 1);
+        }
+        for ( y = GRID_SIZE - 2; y >= 0; y-- ) {
+            grown |= reach_spread(reach, pass, y, y + 1);
+        }
+    }
+}
+
+// Whether any tile is in both sets
+static bool reach_meets(struct Reach* a, struct Reach* b) {
+    unsigned long long any = 0;
+    int y, w;
+
+    for ( y = 0; y < GRID_SIZE; y++ ) {
+        for ( w = 0; w < REACH_WORDS; w++ ) {
+            any |= a->rows[y][w] & b->rows[y][w];
+        }
+    }
+    return any != 0;
+}
+
+// wm_reach, with the tiles already sorted into kinds
+static void wm_reach_sorted(struct WorldModel* wm, struct Reach* kinds, int rules, struct Reach* reach) {
+    struct Reach pass;
+    int old_rules;
+
+    do {
+        old_rules = rules;
+        reach_passable(kinds, rules, &pass);
+        reach_flood(&pass, wm->pos, reach);
+
+        if ( rules & REACH_ITEMS ) {
+            bool axe = wm->axe || reach_meets(reach, &kinds[KIND_AXE]);
+            bool key = wm->key || reach_meets(reach, &kinds[KIND_KEY]);
+            bool raft = wm->raft || ( axe && reach_meets(reach, &kinds[KIND_TREE]) );
+            bool stone = wm->stones > 0 || reach_meets(reach, &kinds[KIND_STONE]);
+
+            if ( axe )           rules |= REACH_TREES;
+            if ( key )           rules |= REACH_DOORS;
+            if ( raft || stone ) rules |= REACH_WATER;
+        }
+    } while ( rules != old_rules );
+}
+
+void wm_reach(struct WorldModel* wm, int rules, struct Reach* reach) {
+    struct Reach kinds[N_KINDS];
+
+    wm_reach_kinds(wm, kinds);
+    wm_reach_sorted(wm, kinds, rules, reach);
+}
+
+bool reach_test(struct Reach* reach, struct Pos pos) {
+    return pos.x >= 0 && pos.x < GRID_SIZE && pos.y >= 0 && pos.y < GRID_SIZE &&
+           ( reach->rows[pos.y][pos.x / 64] >> (pos.x % 64) ) & 1;
+}
+
+// Whether exploring can get anywhere that shows us unknown tiles
+static bool wm_reach_explore(struct WorldModel* wm, struct Reach* kinds) {
+    struct Reach reach, view;
+    unsigned long long shifted[REACH_WORDS];
+    int y, w, k;
+
+    // Exploring never crosses between land and water, and leaves trees
+    // and stones alone
+    int rules = REACH_LAND;
+    if ( wm_get_tile(wm, wm->pos) == TILE_WATER ) {
+        rules = REACH_WATER;
+    } else if ( wm->key ) {
+        rules |= REACH_DOORS;
+    }
+
+    wm_reach_sorted(wm, kinds, rules, &reach);
+
+    // Widen what we reach by what we'd see from it, a row at a time and
+    // then down the columns
+    for ( y = 0; y < GRID_SIZE; y++ ) {
+        memcpy(view.rows[y], reach.rows[y], sizeof(view.rows[y]));
+        for ( k = 1; k <= VIEW_DIST; k++ ) {
+            reach_shift(reach.rows[y], k, shifted);
+            for ( w = 0; w < REACH_WORDS; w++ ) view.rows[y][w] |= shifted[w];
+            reach_shift(reach.rows[y], -k, shifted);
+            for ( w = 0; w < REACH_WORDS; w++ ) view.rows[y][w] |= shifted[w];
+        }
+    }
+    for ( y = 0; y < GRID_SIZE; y++ ) {
+        for ( w = 0; w < REACH_WORDS; w++ ) {
+            unsigned long long bits = 0;
+            for ( k = -VIEW_DIST; k <= VIEW_DIST; k++ ) {
+                if ( y + k >= 0 && y + k < GRID_SIZE ) {
+                    bits |= view.rows[y + k][w];
+                }
+            }
+            if ( bits & kinds[KIND_UNKNOWN].rows[y][w] ) {
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+void wm_reach_goals(struct WorldModel* wm, struct ReachGoals* goals) {
+    struct Reach kinds[N_KINDS];
+    struct Reach reach;
+    int y, w;
+
+    // Everything we could reach picking up the items we come across on
+    // the way. Once we're on the water we can sail on over it, even with
+    // the raft used up.
+    int rules = REACH_LAND | REACH_STONES | REACH_ITEMS;
+    if ( wm_get_tile(wm, wm->pos) == TILE_WATER ) {
+        rules |= REACH_WATER;
+    }
+
+    wm_reach_kinds(wm, kinds);
+    wm_reach_sorted(wm, kinds, rules, &reach);
+
+    // We walked here from home, so we can walk back
+    goals->win = wm->treasure || reach_meets(&reach, &kinds[KIND_TREASURE]);
+
+    goals->new_tiles = 0;
+    for ( y = 0; y < GRID_SIZE; y++ ) {
+        for ( w = 0; w < REACH_WORDS; w++ ) {
+            goals->new_tiles += __builtin_popcountll(reach.rows[y][w] & kinds[KIND_NEW].rows[y][w]);
+        }
+    }
+
+    goals->explore = wm_reach_explore(wm, kinds);
+}
+
+// Point of interest graph
+// The tiles that matter for winning are home, the items and the trees and
+// doors in the way. Each of them can keep the cost of the cheapest path
+// from it to every tile, crossing only plain land and water, with each
+// water tile costing a stone. These are only thrown away when a tile the
+// search reached, or one next to it, changes. A winning plan is then a
+// short search over the order we visit the points in, with the cached
+// paths stitched together.
+//
+// Water can also be crossed once by raft. Where we land depends on where
+// we are headed, so a crossing isn't a point of its own but another kind
+// of leg between two points, sailing from the shore and walking on from
+// wherever we land. Each point keeps the costs of those legs as well.
+//
+// Paths from where we stand are the paths to it from each point, turned
+// around, so they come out of the same caches and a plan made while the
+// view doesn't change works nothing out again.
+//
+// A state keeps the points it has used in a 64 bit mask, so there's room
+// for MAX_POIS points. A map with more has no tour planned over it, and
+// decide falls back to searching the grid. The search over orders stops
+// taking new states once it holds MAX_POI_STATES. A win found after that
+// is still a win, but maybe not the cheapest, and if none turns up the
+// grid search gets its turn as well.
+#define MAX_POIS        64
+#define MAX_POI_STATES  20000
+#define MAX_BRIDGED     8
+#define POI_HASH_SIZE   (1 << 16)
+#define POI_UNREACHED   -1
+
+// Path costs count steps, plus WATER_COST for every water tile, so the
+// cheapest path is the one using the fewest stones
+#define WATER_COST      (1 << 16)
+
+// A leg crossing by raft goes over land to the shore, over the water and
+// over land again, and has a cost for each tile in each of those layers
+#define SAIL_ASHORE     0
+#define SAIL_AFLOAT     1
+#define SAIL_LANDED     2
+#define SAIL_LAYERS     3
+
+struct Poi {
+    struct Pos pos;
+    int (*cost)[GRID_SIZE];                // cached path costs from here, or NULL
+    int (*sail)[GRID_SIZE][GRID_SIZE];     // cached costs by raft from here, or NULL
+};
+
+// A step in the search over the order we visit the points of interest in
+struct PoiState {
+    int at;                   // point we are on, or -1 for where we started
+    int parent;               // state we came from, or -1
+    int cost;
+    bool sailed;              // the leg here crossed the water by raft
+
+    bool axe;
+    bool key;
+    bool treasure;
+    bool raft;
+    int stones;
+
+    unsigned long long used;  // points we picked up, chopped or unlocked
+    int n_bridged;            // water tiles we have put stones on
+    struct Pos bridged[MAX_BRIDGED];
+};
+
+struct PoiGraph {
+    int n_pois;
+    struct Poi pois[MAX_POIS];
+
+    // Some points didn't fit, so the graph doesn't hold them all
+    bool overflow;
+
+    // Room for the searches, made once along with the graph
+    struct HeapNode* queue;    // for the paths from a point
+    struct PoiState* states;   // for the search over orders
+    int* table;
+    struct HeapNode* heap;
+    int* order;
+    struct Pos* path;
+};
+
+static bool wm_is_poi_tile(char tile) {
+    switch(tile) {
+        case TILE_HOME:
+        case TILE_AXE:
+        case TILE_KEY:
+        case TILE_STONE:
+        case TILE_TREASURE:
+        case TILE_TREE:
+        case TILE_DOOR:
+            return true;
+        default:
+            return false;
+    }
+}
+
+static void poi_graph_add(struct PoiGraph* graph, struct Pos pos) {
+    if ( graph->n_pois == MAX_POIS ) {
+        graph->overflow = true;
+        return;
+    }
+    graph->pois[graph->n_pois].pos = pos;
+    graph->pois[graph->n_pois].cost = NULL;
+    graph->pois[graph->n_pois].sail = NULL;
+    graph->n_pois++;
+}
+
+// Once a point has gone, add back any that didn't fit before
+static void poi_graph_refill(struct WorldModel* wm, struct PoiGraph* graph) {
+    int i, j, k;
+
+    graph->overflow = false;
+    for ( i = 0; i < GRID_SIZE; i++ ) {
+        for ( j = 0; j < GRID_SIZE; j++ ) {
+            if ( !wm_is_poi_tile(wm->grid[i][j]) ) {
+                continue;
+            }
+            for ( k = 0; k < graph->n_pois; k++ ) {
+                if ( pos_equal(graph->pois[k].pos, pos_set(j, i)) ) {
+                    break;
+                }
+            }
+            if ( k == graph->n_pois ) {
+                poi_graph_add(graph, pos_set(j, i));
+            }
+        }
+    }
+}
+
+static struct PoiGraph* poi_graph_create(struct WorldModel* wm) {
+    struct PoiGraph* graph = malloc(sizeof(struct PoiGraph));
+    int i, j;
+
+    if ( graph == NULL ) {
+        return NULL;
+    }
+
+    graph->queue  = malloc(sizeof(struct HeapNode) * 4 * (GRID_SIZE) * (GRID_SIZE));
+    graph->states = malloc(sizeof(struct PoiState) * MAX_POI_STATES);
+    graph->table  = malloc(sizeof(int) * POI_HASH_SIZE);
+    graph->heap   = malloc(sizeof(struct HeapNode) * MAX_POI_STATES);
+    graph->order  = malloc(sizeof(int) * MAX_POI_STATES);
+    graph->path   = malloc(sizeof(struct Pos[GRID_SIZE][GRID_SIZE]));
+
+    if ( graph->queue == NULL || graph->states == NULL || graph->table == NULL ||
+         graph->heap == NULL || graph->order == NULL || graph->path == NULL ) {
+        free(graph->queue); free(graph->states); free(graph->table);
+        free(graph->heap); free(graph->order); free(graph->path);
+        free(graph);
+        return NULL;
+    }
+
+    graph->n_pois = 0;
+    graph->overflow = false;
+    for ( i = 0; i < GRID_SIZE; i++ ) {
+        for ( j = 0; j < GRID_SIZE; j++ ) {
+            if ( wm_is_poi_tile(wm->grid[i][j]) ) {
+                poi_graph_add(graph, pos_set(j, i));
+            }
+        }
+    }
+
+    return graph;
+}
+
+static void poi_graph_destroy(struct PoiGraph* graph) {
+    int i;
+
+    if ( graph == NULL ) {
+        return;
+    }
+
+    for ( i = 0; i < graph->n_pois; i++ ) {
+        free(graph->pois[i].cost);
+        free(graph->pois[i].sail);
+    }
+    free(graph->queue);
+    free(graph->states);
+    free(graph->table);
+    free(graph->heap);
+    free(graph->order);
+    free(graph->path);
+    free(graph);
+}
+
+// Tiles a path between points of interest may cross
+static bool wm_poi_crossable(char tile) {
+    return tile == TILE_LAND || tile == TILE_USED_STONE || tile == TILE_HOME || tile == TILE_WATER;
+}
+
+// Tiles a crossing by raft may cross in each layer
+static bool wm_poi_sailable(char tile, int layer) {
+    if ( layer == SAIL_AFLOAT ) {
+        return tile == TILE_WATER;
+    }
+    return tile == TILE_LAND || tile == TILE_USED_STONE || tile == TILE_HOME;
+}
+
+static bool poi_cost_reached(int (*cost)[GRID_SIZE], struct Pos pos) {
+    return pos.x >= 0 && pos.x < GRID_SIZE && pos.y >= 0 && pos.y < GRID_SIZE &&
+           cost[pos.y][pos.x] != POI_UNREACHED;
+}
+
+// Whether the costs reached pos or a tile next to it, so a change to pos
+// could change them
+static bool poi_cost_near(int (*cost)[GRID_SIZE], struct Pos pos) {
+    Direction dir;
+
+    if ( poi_cost_reached(cost, pos) ) {
+        return true;
+    }
+    for ( dir = DIRECTION_UP; dir <= DIRECTION_RIGHT; dir++ ) {
+        if ( poi_cost_reached(cost, pos_forward_rel(pos, 1, dir)) ) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Drop the cached paths a changed tile could affect, and add or remove the
+// point of interest on it
+static void poi_graph_tile_changed(struct WorldModel* wm, struct Pos pos) {
+    struct PoiGraph* graph = wm->pois;
+    int i, layer;
+
+    for ( i = 0; i < graph->n_pois; i++ ) {
+        struct Poi* poi = &graph->pois[i];
+
+        if ( poi->cost != NULL && poi_cost_near(poi->cost, pos) ) {
+            free(poi->cost);
+            poi->cost = NULL;
+        }
+        for ( layer = 0; layer < SAIL_LAYERS && poi->sail != NULL; layer++ ) {
+            if ( poi_cost_near(poi->sail[layer], pos) ) {
+                free(poi->sail);
+                poi->sail = NULL;
+            }
+        }
+    }
+
+    for ( i = 0; i < graph->n_pois; i++ ) {
+        if ( pos_equal(graph->pois[i].pos, pos) ) {
+            break;
+        }
+    }
+
+    bool is_poi = wm_is_poi_tile(wm_get_tile(wm, pos));
+    if ( i < graph->n_pois && !is_poi ) {
+        free(graph->pois[i].cost);
+        free(graph->pois[i].sail);
+        graph->pois[i] = graph->pois[--graph->n_pois];
+        if ( graph->overflow ) {
+            poi_graph_refill(wm, graph);
+        }
+    } else if ( i == graph->n_pois && is_poi ) {
+        poi_graph_add(graph, pos);
+    }
+}
+
+// Dijkstra from source over plain land and water. Other points of interest
+// are reached but not crossed, since crossing them changes what we hold.
+static int (*wm_poi_costs(struct WorldModel* wm, struct HeapNode* heap, struct Pos source))[GRID_SIZE] {
+    int (*cost)[GRID_SIZE] = malloc(sizeof(int[GRID_SIZE][GRID_SIZE]));
+    int capacity = 4 * (GRID_SIZE) * (GRID_SIZE);
+    int size = 0;
+    Direction dir;
+
+    if ( cost == NULL ) {
+        fprintf( stderr, "No memory for wm_poi_costs!\n" );
+        return NULL;
+    }
+
+    memset(cost, POI_UNREACHED, sizeof(int[GRID_SIZE][GRID_SIZE]));
+
+    struct HeapNode start = { 0, 0, source, -1 };
+    cost[source.y][source.x] = 0;
+    heap_push(heap, &size, start);
+
+    while ( size > 0 ) {
+        struct HeapNode cur = heap_pop(heap, &size);
+        char tile = wm_get_tile(wm, cur.pos);
+
+        if ( cur.f > cost[cur.pos.y][cur.pos.x] ) {
+            continue;
+        }
+
+        if ( !pos_equal(cur.pos, source) && !wm_poi_crossable(tile) ) {
+            continue;
+        }
+
+        for ( dir = DIRECTION_UP; dir <= DIRECTION_RIGHT; dir++ ) {
+            struct HeapNode next = cur;
+            next.pos = pos_forward_rel(cur.pos, 1, dir);
+
+            if ( next.pos.x < 0 || next.pos.x >= GRID_SIZE || next.pos.y < 0 || next.pos.y >= GRID_SIZE ) {
+                continue;
+            }
+
+            char next_tile = wm_get_tile(wm, next.pos);
+            if ( next_tile == TILE_UNKNOWN || next_tile == TILE_WALL || next_tile == TILE_OOB ) {
+                continue;
+            }
+
+            next.f = cur.f + 1 + ( next_tile == TILE_WATER ? WATER_COST : 0 );
+            if ( (cost[next.pos.y][next.pos.x] != POI_UNREACHED && cost[next.pos.y][next.pos.x] <= next.f) ||
+                 size == capacity ) {
+                continue;
+            }
+
+            cost[next.pos.y][next.pos.x] = next.f;
+            heap_push(heap, &size, next);
+        }
+    }
+
+    return cost;
+}
+
+// Breadth first search from source over the legs that cross the water once
+// by raft. Queue entries hold their layer in dir, and each tile goes in
+// once per layer.
+static int (*wm_poi_sail_costs(struct WorldModel* wm, struct HeapNode* queue, struct Pos source))[GRID_SIZE][GRID_SIZE] {
+    int (*sail)[GRID_SIZE][GRID_SIZE] = malloc(sizeof(int[SAIL_LAYERS][GRID_SIZE][GRID_SIZE]));
+    int head = 0, tail = 0;
+    Direction dir;
+
+    if ( sail == NULL ) {
+        fprintf( stderr, "No memory for wm_poi_sail_costs!\n" );
+        return NULL;
+    }
+
+    memset(sail, POI_UNREACHED, sizeof(int[SAIL_LAYERS][GRID_SIZE][GRID_SIZE]));
+
+    struct HeapNode start = { 0, 0, source, SAIL_ASHORE };
+    sail[SAIL_ASHORE][source.y][source.x] = 0;
+    queue[tail++] = start;
+
+    while ( head < tail ) {
+        struct HeapNode cur = queue[head++];
+
+        if ( cur.f > 0 && !wm_poi_sailable(wm_get_tile(wm, cur.pos), cur.dir) ) {
+            continue;
+        }
+
+        for ( dir = DIRECTION_UP; dir <= DIRECTION_RIGHT; dir++ ) {
+            struct HeapNode next = cur;
+            next.pos = pos_forward_rel(cur.pos, 1, dir);
+
+            if ( next.pos.x < 0 || next.pos.x >= GRID_SIZE || next.pos.y < 0 || next.pos.y >= GRID_SIZE ) {
+                continue;
+            }
+
+            char next_tile = wm_get_tile(wm, next.pos);
+            if ( next_tile == TILE_UNKNOWN || next_tile == TILE_WALL || next_tile == TILE_OOB ) {
+                continue;
+            }
+
+            // Setting off takes us afloat, and going ashore lands us for good
+            if ( next_tile == TILE_WATER ) {
+                if ( cur.dir == SAIL_LANDED ) {
+                    continue;
+                }
+                next.dir = SAIL_AFLOAT;
+            } else if ( cur.dir == SAIL_AFLOAT ) {
+                next.dir = SAIL_LANDED;
+            }
+
+            next.f = cur.f + 1;
+            if ( sail[next.dir][next.pos.y][next.pos.x] != POI_UNREACHED ) {
+                continue;
+            }
+
+            sail[next.dir][next.pos.y][next.pos.x] = next.f;
+            queue[tail++] = next;
+        }
+    }
+
+    return sail;
+}
+
+// Walk back along the cheapest path to dest, filling path with the tiles
+// after the source up to and including dest. Returns the number of tiles.
+static int wm_poi_path(struct WorldModel* wm, int (*cost)[GRID_SIZE], struct Pos dest, struct Pos* path) {
+    int len = cost[dest.y][dest.x] % WATER_COST;
+    int i = len;
+    struct Pos cur = dest;
+    Direction dir;
+
+    while ( i > 0 ) {
+        path[--i] = cur;
+        int step = 1 + ( wm_get_tile(wm, cur) == TILE_WATER ? WATER_COST : 0 );
+        for ( dir = DIRECTION_UP; dir <= DIRECTION_RIGHT; dir++ ) {
+            struct Pos prev = pos_forward_rel(cur, 1, dir);
+            if ( poi_cost_reached(cost, prev) && cost[prev.y][prev.x] == cost[cur.y][cur.x] - step &&
+                 ( cost[prev.y][prev.x] == 0 || wm_poi_crossable(wm_get_tile(wm, prev)) ) ) {
+                cur = prev;
+                break;
+            }
+        }
+    }
+
+    return len;
+}
+
+// As wm_poi_path, for a leg by raft ending in the given layer
+static int wm_poi_sail_path(struct WorldModel* wm, int (*sail)[GRID_SIZE][GRID_SIZE], struct Pos dest,
+        int layer, struct Pos* path) {
+    int len = sail[layer][dest.y][dest.x];
+    int i = len, prev_layer;
+    struct Pos cur = dest;
+    Direction dir;
+
+    while ( i > 0 ) {
+        path[--i] = cur;
+        bool stepped = false;
+        for ( dir = DIRECTION_UP; dir <= DIRECTION_RIGHT && !stepped; dir++ ) {
+            struct Pos prev = pos_forward_rel(cur, 1, dir);
+            if ( prev.x < 0 || prev.x >= GRID_SIZE || prev.y < 0 || prev.y >= GRID_SIZE ) {
+                continue;
+            }
+
+            // Each step stays in its layer or moves on to the next
+            for ( prev_layer = layer; prev_layer >= 0 && prev_layer >= layer - 1 && !stepped; prev_layer-- ) {
+                int prev_cost = sail[prev_layer][prev.y][prev.x];
+                if ( prev_cost == i &&
+                     ( prev_cost == 0 || wm_poi_sailable(wm_get_tile(wm, prev), prev_layer) ) ) {
+                    cur = prev;
+                    layer = prev_layer;
+                    stepped = true;
+                }
+            }
+        }
+    }
+
+    return len;
+}
+
+// The cached paths from point p, worked out if they're not there yet
+static int (*poi_graph_cost(struct WorldModel* wm, struct PoiGraph* graph, int p))[GRID_SIZE] {
+    struct Poi* poi = &graph->pois[p];
+
+    if ( poi->cost == NULL ) {
+        poi->cost = wm_poi_costs(wm, graph->queue, poi->pos);
+    }
+    return poi->cost;
+}
+
+static int (*poi_graph_sail(struct WorldModel* wm, struct PoiGraph* graph, int p))[GRID_SIZE][GRID_SIZE] {
+    struct Poi* poi = &graph->pois[p];
+
+    if ( poi->sail == NULL ) {
+        poi->sail = wm_poi_sail_costs(wm, graph->queue, poi->pos);
+    }
+    return poi->sail;
+}
+
+// Fill path with the tiles of the cheapest leg to point q, from point p or
+// from where we stand if p < 0, crossing the water once by raft if sail
+// is set and otherwise on stones. Returns the number of tiles, or -1 if
+// there's no such leg.
+static int wm_poi_leg(struct WorldModel* wm, struct PoiGraph* graph, int p, int q, bool sail,
+        struct Pos* path) {
+    struct Pos dest = graph->pois[q].pos;
+    int (*cost)[GRID_SIZE];
+    int (*sail_cost)[GRID_SIZE][GRID_SIZE];
+    int len, i;
+
+    if ( p >= 0 && sail ) {
+        sail_cost = poi_graph_sail(wm, graph, p);
+        if ( sail_cost == NULL || !poi_cost_reached(sail_cost[SAIL_LANDED], dest) ) {
+            return -1;
+        }
+        return wm_poi_sail_path(wm, sail_cost, dest, SAIL_LANDED, path);
+    } else if ( p >= 0 ) {
+        cost = poi_graph_cost(wm, graph, p);
+        if ( cost == NULL || !poi_cost_reached(cost, dest) ) {
+            return -1;
+        }
+        return wm_poi_path(wm, cost, dest, path);
+    }
+
+    // From where we stand, take q's path here and turn it around. Afloat,
+    // we only sail on, since the water we're on takes no stone to leave.
+    struct Pos from = wm->pos;
+    bool afloat = ( wm_get_tile(wm, from) == TILE_WATER );
+    if ( sail ) {
+        int layer = afloat ? SAIL_AFLOAT : SAIL_LANDED;
+        sail_cost = poi_graph_sail(wm, graph, q);
+        if ( sail_cost == NULL || !poi_cost_reached(sail_cost[layer], from) ) {
+            return -1;
+        }
+        len = wm_poi_sail_path(wm, sail_cost, from, layer, path);
+    } else {
+        cost = poi_graph_cost(wm, graph, q);
+        if ( afloat || cost == NULL || !poi_cost_reached(cost, from) ) {
+            return -1;
+        }
+        len = wm_poi_path(wm, cost, from, path);
+    }
+
+    if ( len == 0 ) {
+        return 0;
+    }
+    for ( i = 0; i < (len - 1) / 2; i++ ) {
+        struct Pos tmp = path[i];
+        path[i] = path[len - 2 - i];
+        path[len - 2 - i] = tmp;
+    }
+    path[len - 1] = dest;
+
+    return len;
+}
+
+static bool poi_state_equal(struct PoiState* a, struct PoiState* b) {
+    int i;
+
+    if ( a->at != b->at || a->axe != b->axe || a->key != b->key || a->treasure != b->treasure ||
+         a->raft != b->raft || a->stones != b->stones || a->used != b->used ||
+         a->n_bridged != b->n_bridged ) {
+        return false;
+    }
+    for ( i = 0; i < a->n_bridged; i++ ) {
+        if ( !pos_equal(a->bridged[i], b->bridged[i]) ) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static unsigned int poi_state_hash(struct PoiState* state) {
+    unsigned long long h = state->used * 0x9e3779b97f4a7c15ULL;
+    int i;
+
+    h ^= (unsigned long long)(state->at + 1) * 0xff51afd7ed558ccdULL;
+    h ^= (state->axe << 1) | (state->key << 2) | (state->treasure << 3) | (state->raft << 4) |
+         (state->stones << 5);
+    for ( i = 0; i < state->n_bridged; i++ ) {
+        h = h * 31 + state->bridged[i].y * GRID_SIZE + state->bridged[i].x;
+    }
+    return (unsigned int)(h ^ (h >> 32));
+}
+
+// Try to move from state cur to point q along the len tiles of path.
+// Fills in next and returns false if we can't.
+static bool wm_poi_move(struct WorldModel* wm, struct PoiGraph* graph, struct PoiState* cur, int q,
+        struct Pos* path, int len, bool sail, struct PoiState* next) {
+    struct Poi* poi = &graph->pois[q];
+    int i, j;
+
+    *next = *cur;
+    next->at = q;
+    next->sailed = sail;
+    next->cost = cur->cost + len;
+
+    if ( sail ) {
+        // Setting off from land takes the raft
+        if ( cur->at >= 0 || wm_get_tile(wm, wm->pos) != TILE_WATER ) {
+            next->raft = false;
+        }
+    } else {
+        // Put stones on the water tiles along the way we haven't already
+        for ( i = 0; i < len; i++ ) {
+            if ( wm_get_tile(wm, path[i]) != TILE_WATER ) {
+                continue;
+            }
+            for ( j = 0; j < next->n_bridged && !pos_equal(next->bridged[j], path[i]); j++ );
+            if ( j < next->n_bridged ) {
+                continue;
+            }
+            if ( next->stones <= 0 || next->n_bridged == MAX_BRIDGED ) {
+                return false;
+            }
+            next->stones--;
+
+            // Keep the list sorted so equal states compare equal
+            for ( j = next->n_bridged; j > 0 &&
+                  (next->bridged[j-1].y * GRID_SIZE + next->bridged[j-1].x) >
+                  (path[i].y * GRID_SIZE + path[i].x); j-- ) {
+                next->bridged[j] = next->bridged[j-1];
+            }
+            next->bridged[j] = path[i];
+            next->n_bridged++;
+        }
+    }
+
+    // Use up whatever is there, unless we already have
+    if ( !(cur->used & (1ULL << q)) ) {
+        switch(wm_get_tile(wm, poi->pos)) {
+            case TILE_TREE:
+                if ( !next->axe ) return false;
+                next->raft = true;
+                next->used |= 1ULL << q;
+                break;
+            case TILE_DOOR:
+                if ( !next->key ) return false;
+                next->used |= 1ULL << q;
+                break;
+            case TILE_AXE:
+                next->axe = true;
+                next->used |= 1ULL << q;
+                break;
+            case TILE_KEY:
+                next->key = true;
+                next->used |= 1ULL << q;
+                break;
+            case TILE_STONE:
+                next->stones++;
+                next->used |= 1ULL << q;
+                break;
+            case TILE_TREASURE:
+                next->treasure = true;
+                next->used |= 1ULL << q;
+                break;
+        }
+    }
+
+    return true;
+}
+
+// Keep a state the search reached from parent if it is new or cheaper
+// than before. Heap entries hold the cost in f and the state index in g.
+static void poi_graph_push(struct PoiGraph* graph, int* n_states, int* size, struct PoiState* next,
+        int parent) {
+    unsigned int h = poi_state_hash(next) & (POI_HASH_SIZE - 1);
+
+    while ( graph->table[h] >= 0 && !poi_state_equal(&graph->states[graph->table[h]], next) ) {
+        h = (h + 1) & (POI_HASH_SIZE - 1);
+    }
+
+    int index = graph->table[h];
+    if ( (index >= 0 && graph->states[index].cost <= next->cost) || *size == MAX_POI_STATES ) {
+        return;
+    }
+    if ( index < 0 ) {
+        if ( *n_states == POI_HASH_SIZE / 2 ) {
+            return;
+        }
+        index = (*n_states)++;
+        graph->table[h] = index;
+    }
+
+    next->parent = parent;
+    graph->states[index] = *next;
+
+    struct HeapNode node = { next->cost, index, graph->pois[next->at].pos, -1 };
+    heap_push(graph->heap, size, node);
+}
+
+// Plan a win as a tour of the points of interest
+bool wm_poi_win(struct WorldModel* wm, char* actions) {
+    struct PoiGraph* graph = wm->pois;
+    int n_states = 0, size = 0;
+    int i, goal = -1;
+
+    actions[0] = '\0';
+
+    // A tour leaving out points that didn't fit could miss the only way
+    // to win, so leave maps this busy to the grid search
+    if ( graph == NULL || graph->overflow ) {
+        return false;
+    }
+
+    // Nothing to plan unless we know where the treasure is or hold it
+    for ( i = 0; i < graph->n_pois && !wm->treasure; i++ ) {
+        if ( wm_get_tile(wm, graph->pois[i].pos) == TILE_TREASURE ) {
+            break;
+        }
+    }
+    if ( i == graph->n_pois ) {
+        return false;
+    }
+
+    struct PoiState* states = graph->states;
+    struct Pos* path = graph->path;
+
+    memset(graph->table, -1, sizeof(int) * POI_HASH_SIZE);
+
+    struct PoiState* start = &states[n_states++];
+    start->at        = -1;
+    start->parent    = -1;
+    start->cost      = 0;
+    start->sailed    = false;
+    start->axe       = wm->axe;
+    start->key       = wm->key;
+    start->treasure  = wm->treasure;
+    start->raft      = wm->raft;
+    start->stones    = wm->stones;
+    start->used      = 0;
+    start->n_bridged = 0;
+
+    struct HeapNode node = { 0, 0, wm->pos, -1 };
+    heap_push(graph->heap, &size, node);
+
+    // Dijkstra over visiting orders
+    while ( size > 0 && goal < 0 ) {
+        node = heap_pop(graph->heap, &size);
+        struct PoiState cur = states[node.g];
+
+        if ( node.f > cur.cost ) {
+            continue;
+        }
+
+        if ( cur.treasure && cur.at >= 0 && pos_equal(graph->pois[cur.at].pos, pos_set(HOME_POS, HOME_POS)) ) {
+            goal = node.g;
+            break;
+        }
+
+        // We can sail once we hold the raft and no stones, since the
+        // engine drops a stone we hold first. Afloat already, we sail on.
+        bool can_sail = ( cur.raft && cur.stones == 0 ) ||
+                        ( cur.at < 0 && wm_get_tile(wm, wm->pos) == TILE_WATER );
+
+        // Past MAX_POI_STATES no new states are taken, and the search
+        // finishes with those it has
+        int q, leg;
+        for ( q = 0; q < graph->n_pois && n_states < MAX_POI_STATES; q++ ) {
+            for ( leg = 0; leg < 2 && n_states < MAX_POI_STATES; leg++ ) {
+                bool sail = ( leg == 1 );
+                struct PoiState next;
+
+                if ( q == cur.at || ( sail && !can_sail ) ) {
+                    continue;
+                }
+                int len = wm_poi_leg(wm, graph, cur.at, q, sail, path);
+                if ( len < 0 || !wm_poi_move(wm, graph, &cur, q, path, len, sail, &next) ) {
+                    continue;
+                }
+                poi_graph_push(graph, &n_states, &size, &next, node.g);
+            }
+        }
+    }
+
+    bool found = false;
+
+    if ( goal >= 0 ) {
+        // Collect the points we visit, in order
+        int* order = graph->order;
+        int n_order = 0;
+        for ( i = goal; states[i].parent >= 0; i = states[i].parent ) {
+            order[n_order++] = i;
+        }
+
+        // Walk the legs on a copy of the world, checking every step is one
+        // we are allowed to make and that the actions fit
+        struct WorldModel* plan_wm = wm_copy(wm);
+        char* end = actions;
+        found = ( plan_wm != NULL );
+
+        for ( i = n_order - 1; i >= 0 && found; i-- ) {
+            struct PoiState* from = &states[states[order[i]].parent];
+            struct PoiState* to = &states[order[i]];
+            int len = wm_poi_leg(wm, graph, from->at, to->at, to->sailed, path);
+            int k;
+
+            found = ( len >= 0 );
+            for ( k = 0; k < len && found; k++ ) {
+                if ( end - actions > MAX_PATH_LEN - 5 ||
+                     !wm_walk_test_permissible(plan_wm, path[k], GOAL_WIN) ) {
+                    found = false;
+                } else {
+                    end = wm_step_to(plan_wm, path[k], end);
+                }
+            }
+        }
+
+        found = found && plan_wm->treasure && pos_equal(plan_wm->pos, pos_set(HOME_POS, HOME_POS));
+        end[0] = '\0';
+        if ( !found ) {
+            actions[0] = '\0';
+        }
+
+        wm_destroy(plan_wm);
+    }
+
+    return found;
+}
+
+
+// Full knowledge solver
+// An A* search over whole game states, to measure the agent against the
+// best possible plan on maps we are given in full. A state is the
+// agent's position, direction and raft, which items, trees and doors are
+// gone, and which water tiles hold stones. What the agent holds follows
+// from those. States are packed into a few words, with each field only
+// as wide as the map needs.
+//
+// The heuristic is the number of actions to the treasure and home if we
+// could walk through anything but walls. An action can lower it by at
+// most one and raise it by at most five (stepping back and turning
+// around twice), so states come out of the open list in buckets by f,
+// each only adding to its own bucket or the next few. Every bucket is
+// shared out between threads, and the states seen are kept in a hash
+// table split into shards with a lock each.
+
+#define SOLVE_MAX_WORDS 8
+#define SOLVE_SHARDS    64
+#define SOLVE_CHUNK     256
+#define SOLVE_NO_PARENT (~0ULL)
+#define SOLVE_FAR       INT_MAX
+// Buckets an expansion can add to, from f to f+6
+#define SOLVE_SPREAD    7
+
+struct SolveLayout {
+    // The part of the grid the map covers
+    struct Pos origin;
+    int width;
+    int height;
+
+    // Items, trees and doors, which can each only go once
+    int n_toggles;
+    struct Pos* toggles;
+
+    // Water tiles, and a slot for every stone there is. Slots hold the
+    // indices of water tiles with stones in ascending order, with the
+    // free slots last.
+    int n_water;
+    struct Pos* water;
+    int n_slots;
+
+    // Index of every tile in toggles or water, or -1
+    int (*index)[GRID_SIZE];
+
+    // Bit offsets and widths of the fields
+    int pos_bits;
+    int dir_off;
+    int raft_off;
+    int toggle_off;
+    int slot_off;
+    int slot_bits;
+    int words;
+};
+
+struct SolveShard {
+    pthread_mutex_t lock;
+    unsigned int size;
+    unsigned int cap;
+    unsigned long long* keys;
+    unsigned long long* parent;
+    int* g;
+    char* action;
+
+    // Open addressed table of entry index + 1, or 0 when free
+    unsigned int* table;
+    unsigned int table_size;
+};
+
+struct SolveFrontier {
+    long size;
+    long cap;
+    unsigned long long* ids;
+    int* g;
+    unsigned long long* keys;
+};
+
+struct SolveSearch {
+    struct SolveLayout* layout;
+    struct WorldModel* start;
+    struct SolveShard shards[SOLVE_SHARDS];
+
+    // Relaxed actions home, and home by way of the treasure
+    int (*home_dist)[GRID_SIZE][4];
+    int (*win_dist)[GRID_SIZE][4];
+
+    // The bucket being expanded
+    int f;
+    struct SolveFrontier frontier;
+    long next_chunk;
+
+    // Set by the workers while others read them, so only touched with
+    // __atomic loads and stores until the workers are joined
+    bool found;
+    bool failed;
+    unsigned long long goal;
+    pthread_mutex_t goal_lock;
+};
+
+struct SolveWorker {
+    pthread_t thread;
+    struct SolveSearch* search;
+    struct WorldModel* wm;
+
+    // New states for buckets f onwards
+    struct SolveFrontier next[SOLVE_SPREAD];
+};
+
+// Number of bits needed to hold values up to n
+static int solve_bits(int n) {
+    int bits = 0;
+    while ( (1 << bits) <= n ) {
+        bits++;
+    }
+    return bits;
+}
+
+static unsigned long long solve_get(unsigned long long* key, int off, int bits) {
+    unsigned long long value = key[off / 64] >> (off % 64);
+    if ( off % 64 + bits > 64 ) {
+        value |= key[off / 64 + 1] << (64 - off % 64);
+    }
+    return value & ((1ULL << bits) - 1);
+}
+
+static void solve_put(unsigned long long* key, int off, int bits, unsigned long long value) {
+    unsigned long long mask = (1ULL << bits) - 1;
+    key[off / 64] = (key[off / 64] & ~(mask << (off % 64))) | (value << (off % 64));
+    if ( off % 64 + bits > 64 ) {
+        int shift = 64 - off % 64;
+        key[off / 64 + 1] = (key[off / 64 + 1] & ~(mask >> shift)) | (value >> shift);
+    }
+}
+
+static bool wm_is_toggle_tile(char tile) {
+    return tile == TILE_KEY || tile == TILE_AXE || tile == TILE_STONE ||
+           tile == TILE_TREASURE || tile == TILE_TREE || tile == TILE_DOOR;
+}
+
+static void solve_layout_destroy(struct SolveLayout* layout) {
+    if ( layout == NULL ) {
+        return;
+    }
+
+    free(layout->toggles);
+    free(layout->water);
+    free(layout->index);
+    free(layout);
+}
+
+static struct SolveLayout* solve_layout_create(struct WorldModel* wm) {
+    struct SolveLayout* layout = calloc(1, sizeof(struct SolveLayout));
+    if ( layout == NULL ) {
+        fprintf(stderr, "No memory for wm_solve!\n");
+        return NULL;
+    }
+
+    layout->toggles = malloc(sizeof(struct Pos[GRID_SIZE][GRID_SIZE]));
+    layout->water   = malloc(sizeof(struct Pos[GRID_SIZE][GRID_SIZE]));
+    layout->index   = malloc(sizeof(int[GRID_SIZE][GRID_SIZE]));
+    if ( layout->toggles == NULL || layout->water == NULL || layout->index == NULL ) {
+        fprintf(stderr, "No memory for wm_solve!\n");
+        solve_layout_destroy(layout);
+        return NULL;
+    }
+
+    int x, y;
+    int min_x = GRID_SIZE, min_y = GRID_SIZE, max_x = -1, max_y = -1;
+    layout->n_slots = wm->stones;
+
+    for ( y = 0; y < GRID_SIZE; y++ ) {
+        for ( x = 0; x < GRID_SIZE; x++ ) {
+            char tile = wm->grid[y][x];
+            layout->index[y][x] = -1;
+
+            if ( tile == TILE_OOB || tile == TILE_UNKNOWN ) {
+                continue;
+            }
+            if ( x < min_x ) min_x = x;
+            if ( y < min_y ) min_y = y;
+            if ( x > max_x ) max_x = x;
+            if ( y > max_y ) max_y = y;
+
+            if ( wm_is_toggle_tile(tile) ) {
+                layout->index[y][x] = layout->n_toggles;
+                layout->toggles[layout->n_toggles++] = pos_set(x, y);
+            } else if ( tile == TILE_WATER ) {
+                layout->index[y][x] = layout->n_water;
+                layout->water[layout->n_water++] = pos_set(x, y);
+            }
+            if ( tile == TILE_STONE ) {
+                layout->n_slots++;
+            }
+        }
+    }
+
+    layout->origin = pos_set(min_x, min_y);
+    layout->width  = max_x - min_x + 1;
+    layout->height = max_y - min_y + 1;
+
+    layout->pos_bits   = solve_bits(layout->width * layout->height - 1);
+    layout->dir_off    = layout->pos_bits;
+    layout->raft_off   = layout->dir_off + 2;
+    layout->toggle_off = layout->raft_off + 1;
+    layout->slot_off   = layout->toggle_off + layout->n_toggles;
+    // The all ones value marks a free slot
+    layout->slot_bits  = solve_bits(layout->n_water);
+
+    int bits = layout->slot_off + layout->n_slots * layout->slot_bits;
+    layout->words = (bits + 63) / 64;
+    if ( layout->words > SOLVE_MAX_WORDS ) {
+        fprintf(stderr, "Too many items and stones for wm_solve!\n");
+        solve_layout_destroy(layout);
+        return NULL;
+    }
+
+    return layout;
+}
+
+static int solve_pos_index(struct SolveLayout* layout, struct Pos pos) {
+    return (pos.y - layout->origin.y) * layout->width + pos.x - layout->origin.x;
+}
+
+static unsigned long long solve_slot(struct SolveLayout* layout, unsigned long long* key, int i) {
+    return solve_get(key, layout->slot_off + i * layout->slot_bits, layout->slot_bits);
+}
+
+// Put a stone in a water tile, keeping the slots in order. There's always
+// a free slot for it, since we had to be holding the stone.
+static void solve_place_stone(struct SolveLayout* layout, unsigned long long* key, int water) {
+    int i = layout->n_slots - 1;
+
+    while ( i > 0 && solve_slot(layout, key, i - 1) > (unsigned long long)water ) {
+        solve_put(key, layout->slot_off + i * layout->slot_bits, layout->slot_bits,
+                  solve_slot(layout, key, i - 1));
+        i--;
+    }
+    solve_put(key, layout->slot_off + i * layout->slot_bits, layout->slot_bits, water);
+}
+
+// Make wm, a copy of the starting world model, match the state in key
+static void solve_decode(struct SolveSearch* search, unsigned long long* key, struct WorldModel* wm) {
+    struct SolveLayout* layout = search->layout;
+    struct WorldModel* start = search->start;
+    unsigned long long free_slot = (1ULL << layout->slot_bits) - 1;
+    int i;
+
+    int pos = solve_get(key, 0, layout->pos_bits);
+    wm->pos  = pos_set(layout->origin.x + pos % layout->width, layout->origin.y + pos / layout->width);
+    wm->dir  = solve_get(key, layout->dir_off, 2);
+    wm->raft = solve_get(key, layout->raft_off, 1);
+
+    wm->treasure = start->treasure;
+    wm->key      = start->key;
+    wm->axe      = start->axe;
+    wm->stones   = start->stones;
+
+    for ( i = 0; i < layout->n_toggles; i++ ) {
+        if ( !solve_get(key, layout->toggle_off + i, 1) ) {
+            continue;
+        }
+        struct Pos toggle = layout->toggles[i];
+        switch ( wm_get_tile(start, toggle) ) {
+            case TILE_KEY:      wm->key = true;      break;
+            case TILE_AXE:      wm->axe = true;      break;
+            case TILE_STONE:    wm->stones++;        break;
+            case TILE_TREASURE: wm->treasure = true; break;
+        }
+        wm->grid[toggle.y][toggle.x] = TILE_LAND;
+    }
+
+    for ( i = 0; i < layout->n_slots; i++ ) {
+        unsigned long long water = solve_slot(layout, key, i);
+        if ( water == free_slot ) {
+            break;
+        }
+        struct Pos stone = layout->water[water];
+        wm->grid[stone.y][stone.x] = TILE_USED_STONE;
+        wm->stones--;
+    }
+}
+
+// Put back the tiles solve_decode changed
+static void solve_undo(struct SolveSearch* search, unsigned long long* key, struct WorldModel* wm) {
+    struct SolveLayout* layout = search->layout;
+    unsigned long long free_slot = (1ULL << layout->slot_bits) - 1;
+    int i;
+
+    for ( i = 0; i < layout->n_toggles; i++ ) {
+        if ( solve_get(key, layout->toggle_off + i, 1) ) {
+            struct Pos toggle = layout->toggles[i];
+            wm->grid[toggle.y][toggle.x] = search->start->grid[toggle.y][toggle.x];
+        }
+    }
+
+    for ( i = 0; i < layout->n_slots; i++ ) {
+        unsigned long long water = solve_slot(layout, key, i);
+        if ( water == free_slot ) {
+            break;
+        }
+        struct Pos stone = layout->water[water];
+        wm->grid[stone.y][stone.x] = TILE_WATER;
+    }
+}
+
+// Whether the game engine would let us take the action. wm_take_action
+// trusts the planners to only ask for these.
+static bool wm_solve_legal(struct WorldModel* wm, char action) {
+    char forward_tile = wm_get_tile(wm, pos_forward_rel(wm->pos, 1, wm->dir));
+
+    switch ( action ) {
+        case ACTION_FORWARD:
+            switch ( forward_tile ) {
+                case TILE_HOME:
+                case TILE_LAND:
+                case TILE_USED_STONE:
+                case TILE_KEY:
+                case TILE_STONE:
+                case TILE_AXE:
+                case TILE_TREASURE:
+                    return true;
+                case TILE_WATER:
+                    return wm_get_tile(wm, wm->pos) == TILE_WATER || wm->stones > 0 || wm->raft;
+                default:
+                    return false;
+            }
+        case ACTION_CHOP:
+            return forward_tile == TILE_TREE && wm->axe;
+        case ACTION_UNLOCK:
+            return forward_tile == TILE_DOOR && wm->key;
+        default:
+            return true;
+    }
+}
+
+// Actions from every tile and direction to the nearest source, walking
+// through anything but walls. Sources are given as their starting
+// distances in dist, with everything else SOLVE_FAR.
+static void solve_relaxed_dist(struct WorldModel* wm, int (*dist)[GRID_SIZE][4], struct HeapNode* heap) {
+    int size = 0;
+    int x, y, i;
+
+    for ( y = 0; y < GRID_SIZE; y++ ) {
+        for ( x = 0; x < GRID_SIZE; x++ ) {
+            for ( i = 0; i < 4; i++ ) {
+                if ( dist[y][x][i] != SOLVE_FAR ) {
+                    struct HeapNode node = { dist[y][x][i], 0, pos_set(x, y), i };
+                    heap_push(heap, &size, node);
+                }
+            }
+        }
+    }
+
+    // Search backwards, so from each state we look at the turns and the
+    // step that lead to it
+    while ( size > 0 ) {
+        struct HeapNode cur = heap_pop(heap, &size);
+        if ( cur.f > dist[cur.pos.y][cur.pos.x][cur.dir] ) {
+            continue;
+        }
+
+        struct HeapNode prev[3] = {
+            { cur.f + 1, 0, cur.pos, dir_turn_left(cur.dir) },
+            { cur.f + 1, 0, cur.pos, dir_turn_right(cur.dir) },
+            { cur.f + 1, 0, pos_forward_rel(cur.pos, -1, cur.dir), cur.dir }
+        };
+        for ( i = 0; i < 3; i++ ) {
+            struct Pos pos = prev[i].pos;
+            if ( pos.x < 0 || pos.x >= GRID_SIZE || pos.y < 0 || pos.y >= GRID_SIZE ) {
+                continue;
+            }
+            char tile = wm_get_tile(wm, pos);
+            if ( tile == TILE_WALL || tile == TILE_OOB || tile == TILE_UNKNOWN ) {
+                continue;
+            }
+            if ( prev[i].f < dist[pos.y][pos.x][prev[i].dir] ) {
+                dist[pos.y][pos.x][prev[i].dir] = prev[i].f;
+                heap_push(heap, &size, prev[i]);
+            }
+        }
+    }
+}
+
+static bool solve_dist_create(struct SolveSearch* search) {
+    struct WorldModel* wm = search->start;
+    int x, y, i;
+
+    search->home_dist = malloc(sizeof(int[GRID_SIZE][GRID_SIZE][4]));
+    search->win_dist  = malloc(sizeof(int[GRID_SIZE][GRID_SIZE][4]));
+    // Every state is pushed at most once per way into it
+    struct HeapNode* heap = malloc(sizeof(struct HeapNode[GRID_SIZE][GRID_SIZE][4]) * 3);
+    if ( search->home_dist == NULL || search->win_dist == NULL || heap == NULL ) {
+        free(heap);
+        return false;
+    }
+
+    for ( y = 0; y < GRID_SIZE; y++ ) {
+        for ( x = 0; x < GRID_SIZE; x++ ) {
+            for ( i = 0; i < 4; i++ ) {
+                search->home_dist[y][x][i] = SOLVE_FAR;
+                search->win_dist[y][x][i]  = SOLVE_FAR;
+            }
+        }
+    }
+    for ( i = 0; i < 4; i++ ) {
+        search->home_dist[HOME_POS][HOME_POS][i] = 0;
+    }
+    solve_relaxed_dist(wm, search->home_dist, heap);
+
+    for ( y = 0; y < GRID_SIZE; y++ ) {
+        for ( x = 0; x < GRID_SIZE; x++ ) {
+            if ( wm->grid[y][x] == TILE_TREASURE ) {
+                for ( i = 0; i < 4; i++ ) {
+                    search->win_dist[y][x][i] = search->home_dist[y][x][i];
+                }
+            }
+        }
+    }
+    solve_relaxed_dist(wm, search->win_dist, heap);
+
+    free(heap);
+    return true;
+}
+
+static int solve_heuristic(struct SolveSearch* search, struct WorldModel* wm) {
+    if ( wm->treasure ) {
+        return search->home_dist[wm->pos.y][wm->pos.x][wm->dir];
+    }
+    return search->win_dist[wm->pos.y][wm->pos.x][wm->dir];
+}
+
+static unsigned long long solve_hash(unsigned long long* key, int words) {
+    unsigned long long hash = 0x9e3779b97f4a7c15ULL;
+    int i;
+
+    for ( i = 0; i < words; i++ ) {
+        hash = (hash ^ key[i]) * 0xbf58476d1ce4e5b9ULL;
+        hash ^= hash >> 31;
+    }
+    return hash;
+}
+
+static bool solve_shard_grow(struct SolveShard* shard, int words) {
+    unsigned int i;
+
+    if ( shard->size == shard->cap ) {
+        unsigned int cap = shard->cap * 2;
+        unsigned long long* keys = realloc(shard->keys, sizeof(unsigned long long) * cap * words);
+        if ( keys == NULL ) {
+            return false;
+        }
+        shard->keys = keys;
+        unsigned long long* parent = realloc(shard->parent, sizeof(unsigned long long) * cap);
+        if ( parent == NULL ) {
+            return false;
+        }
+        shard->parent = parent;
+        int* g = realloc(shard->g, sizeof(int) * cap);
+        if ( g == NULL ) {
+            return false;
+        }
+        shard->g = g;
+        char* action = realloc(shard->action, cap);
+        if ( action == NULL ) {
+            return false;
+        }
+        shard->action = action;
+        shard->cap = cap;
+    }
+
+    // Keep the table at most half full
+    if ( 2 * (shard->size + 1) > shard->table_size ) {
+        unsigned int size = shard->table_size * 2;
+        unsigned int* table = calloc(size, sizeof(unsigned int));
+        if ( table == NULL ) {
+            return false;
+        }
+        for ( i = 0; i < shard->size; i++ ) {
+            unsigned int slot = (solve_hash(&shard->keys[i * words], words) >> 6) & (size - 1);
+            while ( table[slot] != 0 ) {
+                slot = (slot + 1) & (size - 1);
+            }
+            table[slot] = i + 1;
+        }
+        free(shard->table);
+        shard->table = table;
+        shard->table_size = size;
+    }
+
+    return true;
+}
+
+// Add a state to those seen, or shorten the way to it. Returns false if
+// we already knew a way at least as short.
+static bool solve_insert(struct SolveSearch* search, unsigned long long* key, int g,
+                         unsigned long long parent, char action, unsigned long long* id) {
+    int words = search->layout->words;
+    unsigned long long hash = solve_hash(key, words);
+    int s = hash % SOLVE_SHARDS;
+    struct SolveShard* shard = &search->shards[s];
+    unsigned int i;
+
+    pthread_mutex_lock(&shard->lock);
+
+    unsigned int slot = (hash >> 6) & (shard->table_size - 1);
+    while ( shard->table[slot] != 0 ) {
+        i = shard->table[slot] - 1;
+        if ( memcmp(&shard->keys[i * words], key, sizeof(unsigned long long) * words) == 0 ) {
+            bool shorter = g < shard->g[i];
+            if ( shorter ) {
+                shard->g[i] = g;
+                shard->parent[i] = parent;
+                shard->action[i] = action;
+            }
+            pthread_mutex_unlock(&shard->lock);
+            *id = ((unsigned long long)i * SOLVE_SHARDS) + s;
+            return shorter;
+        }
+        slot = (slot + 1) & (shard->table_size - 1);
+    }
+
+    if ( !solve_shard_grow(shard, words) ) {
+        fprintf(stderr, "No memory for wm_solve!\n");
+        __atomic_store_n(&search->failed, true, __ATOMIC_RELEASE);
+        pthread_mutex_unlock(&shard->lock);
+        return false;
+    }
+
+    // Growing the table moves everything, so look for a free slot again
+    slot = (hash >> 6) & (shard->table_size - 1);
+    while ( shard->table[slot] != 0 ) {
+        slot = (slot + 1) & (shard->table_size - 1);
+    }
+
+    i = shard->size++;
+    memcpy(&shard->keys[i * words], key, sizeof(unsigned long long) * words);
+    shard->parent[i] = parent;
+    shard->g[i] = g;
+    shard->action[i] = action;
+    shard->table[slot] = i + 1;
+
+    pthread_mutex_unlock(&shard->lock);
+
+    *id = ((unsigned long long)i * SOLVE_SHARDS) + s;
+    return true;
+}
+
+static bool solve_frontier_push(struct SolveFrontier* frontier, unsigned long long id, int g,
+                                unsigned long long* key, int words) {
+    if ( frontier->size == frontier->cap ) {
+        long cap = frontier->cap == 0 ? 1024 : frontier->cap * 2;
+        unsigned long long* ids = realloc(frontier->ids, sizeof(unsigned long long) * cap);
+        if ( ids == NULL ) {
+            return false;
+        }
+        frontier->ids = ids;
+        int* gs = realloc(frontier->g, sizeof(int) * cap);
+        if ( gs == NULL ) {
+            return false;
+        }
+        frontier->g = gs;
+        unsigned long long* keys = realloc(frontier->keys, sizeof(unsigned long long) * cap * words);
+        if ( keys == NULL ) {
+            return false;
+        }
+        frontier->keys = keys;
+        frontier->cap = cap;
+    }
+
+    frontier->ids[frontier->size] = id;
+    frontier->g[frontier->size] = g;
+    memcpy(&frontier->keys[frontier->size * words], key, sizeof(unsigned long long) * words);
+    frontier->size++;
+    return true;
+}
+
+static void solve_frontier_free(struct SolveFrontier* frontier) {
+    free(frontier->ids);
+    free(frontier->g);
+    free(frontier->keys);
+}
+
+// Try every legal action from a state, queueing the states we've found a
+// shorter way to into the buckets for their f
+static void solve_expand(struct SolveWorker* worker, unsigned long long id, int g, unsigned long long* key) {
+    static const char actions[] = { ACTION_FORWARD, ACTION_LEFT, ACTION_RIGHT, ACTION_CHOP, ACTION_UNLOCK };
+    struct SolveSearch* search = worker->search;
+    struct SolveLayout* layout = search->layout;
+    struct WorldModel* wm = worker->wm;
+    unsigned long long next[SOLVE_MAX_WORDS];
+    unsigned long long next_id;
+    int i;
+
+    solve_decode(search, key, wm);
+
+    // States leave the open list in order of f, so the first win is best
+    if ( wm->treasure && pos_equal(wm->pos, pos_set(HOME_POS, HOME_POS)) ) {
+        pthread_mutex_lock(&search->goal_lock);
+        if ( !search->found ) {
+            search->goal = id;
+            __atomic_store_n(&search->found, true, __ATOMIC_RELEASE);
+        }
+        pthread_mutex_unlock(&search->goal_lock);
+        solve_undo(search, key, wm);
+        return;
+    }
+
+    for ( i = 0; i < (int)sizeof(actions); i++ ) {
+        if ( !wm_solve_legal(wm, actions[i]) ) {
+            continue;
+        }
+
+        // Everything wm_take_action can change
+        struct Pos forward_pos = pos_forward_rel(wm->pos, 1, wm->dir);
+        char forward_tile = wm_get_tile(wm, forward_pos);
+        struct Pos pos = wm->pos;
+        Direction dir  = wm->dir;
+        bool treasure  = wm->treasure;
+        bool has_key   = wm->key;
+        bool axe       = wm->axe;
+        bool raft      = wm->raft;
+        int stones     = wm->stones;
+
+        wm_take_action(wm, actions[i]);
+
+        memcpy(next, key, sizeof(unsigned long long) * layout->words);
+        solve_put(next, 0, layout->pos_bits, solve_pos_index(layout, wm->pos));
+        solve_put(next, layout->dir_off, 2, wm->dir);
+        solve_put(next, layout->raft_off, 1, wm->raft);
+        if ( wm_get_tile(wm, forward_pos) != forward_tile ) {
+            int index = layout->index[forward_pos.y][forward_pos.x];
+            if ( forward_tile == TILE_WATER ) {
+                solve_place_stone(layout, next, index);
+            } else {
+                solve_put(next, layout->toggle_off + index, 1, 1);
+            }
+        }
+        int h = solve_heuristic(search, wm);
+
+        wm->grid[forward_pos.y][forward_pos.x] = forward_tile;
+        wm->pos      = pos;
+        wm->dir      = dir;
+        wm->treasure = treasure;
+        wm->key      = has_key;
+        wm->axe      = axe;
+        wm->raft     = raft;
+        wm->stones   = stones;
+
+        if ( h == SOLVE_FAR || !solve_insert(search, next, g + 1, id, actions[i], &next_id) ) {
+            continue;
+        }
+
+        int bucket = g + 1 + h - search->f;
+        assert(bucket >= 0 && bucket < SOLVE_SPREAD);
+        if ( !solve_frontier_push(&worker->next[bucket], next_id, g + 1, next, layout->words) ) {
+            fprintf(stderr, "No memory for wm_solve!\n");
+            __atomic_store_n(&search->failed, true, __ATOMIC_RELEASE);
+        }
+    }
+
+    solve_undo(search, key, wm);
+}
+
+static void* solve_worker(void* arg) {
+    struct SolveWorker* worker = arg;
+    struct SolveSearch* search = worker->search;
+    struct SolveFrontier* frontier = &search->frontier;
+    int words = search->layout->words;
+    long i;
+
+    while ( !__atomic_load_n(&search->found, __ATOMIC_ACQUIRE) &&
+            !__atomic_load_n(&search->failed, __ATOMIC_ACQUIRE) ) {
+        long start = __atomic_fetch_add(&search->next_chunk, SOLVE_CHUNK, __ATOMIC_RELAXED);
+        if ( start >= frontier->size ) {
+            break;
+        }
+        long end = start + SOLVE_CHUNK;
+        if ( end > frontier->size ) {
+            end = frontier->size;
+        }
+        for ( i = start; i < end; i++ ) {
+            solve_expand(worker, frontier->ids[i], frontier->g[i], &frontier->keys[i * words]);
+        }
+    }
+
+    return NULL;
+}
+
+// Reads a whole map in the game engine's format, with the agent's start
+// marked by the way it faces ('^', '>', 'v' or '<'). The map is turned so
+// the agent starts facing up, like world models built while playing.
+struct WorldModel* wm_load_map(FILE* in) {
+    static char lines[GRID_SIZE][GRID_SIZE + 2];
+    int n_lines = 0;
+    int sx = -1, sy = -1;
+    int i, j;
+
+    while ( n_lines < GRID_SIZE && fgets(lines[n_lines], sizeof(lines[n_lines]), in) != NULL ) {
+        lines[n_lines][strcspn(lines[n_lines], "\r\n")] = '\0';
+        for ( j = 0; lines[n_lines][j] != '\0'; j++ ) {
+            if ( strchr("^>v<", lines[n_lines][j]) != NULL ) {
+                sx = j;
+                sy = n_lines;
+            }
+        }
+        n_lines++;
+    }
+
+    if ( sx < 0 ) {
+        fprintf(stderr, "No start in the map for wm_load_map!\n");
+        return NULL;
+    }
+
+    // The agent's forward and right in map coordinates
+    int fx = 0, fy = 0;
+    switch ( lines[sy][sx] ) {
+        case '^': fy = -1; break;
+        case '>': fx = 1;  break;
+        case 'v': fy = 1;  break;
+        case '<': fx = -1; break;
+    }
+    int rx = -fy, ry = fx;
+
+    struct WorldModel* wm = malloc(sizeof(struct WorldModel));
+    if ( wm == NULL ) {
+        fprintf(stderr, "No memory for wm_load_map!\n");
+        return NULL;
+    }
+
+    for ( i = 0; i < GRID_SIZE; i++ ) {
+        for ( j = 0; j < GRID_SIZE; j++ ) {
+            wm->grid[i][j] = TILE_OOB;
+            wm->been[i][j] = false;
+        }
+    }
+
+    for ( i = 0; i < n_lines; i++ ) {
+        for ( j = 0; lines[i][j] != '\0'; j++ ) {
+            int forward = (j - sx) * fx + (i - sy) * fy;
+            int right   = (j - sx) * rx + (i - sy) * ry;
+            int x = HOME_POS + right;
+            int y = HOME_POS - forward;
+            if ( x < 0 || x >= GRID_SIZE || y < 0 || y >= GRID_SIZE ) {
+                fprintf(stderr, "Map too big for wm_load_map!\n");
+                free(wm);
+                return NULL;
+            }
+            wm->grid[y][x] = lines[i][j];
+        }
+    }
+
+    wm->dir = DIRECTION_UP;
+    wm->pos = pos_set(HOME_POS, HOME_POS);
+    wm->grid[HOME_POS][HOME_POS] = TILE_HOME;
+    wm->been[HOME_POS][HOME_POS] = true;
+
+    wm->treasure = false;
+    wm->key      = false;
+    wm->axe      = false;
+    wm->raft     = false;
+    wm->stones   = 0;
+
+    // Nothing is unknown and nothing changes, so there's nothing to keep
+    wm->unknown_sat = NULL;
+    wm->pois = NULL;
+    wm->seen = NULL;
+
+    return wm;
+}
+
+// A world model of the map as we first saw it, with the agent back home
+// holding nothing, to solve the game we have played from the start
+struct WorldModel* wm_seen_copy(struct WorldModel* wm) {
+    struct WorldModel* new_wm = wm_copy(wm);
+    int i, j;
+
+    if ( new_wm == NULL ) {
+        return NULL;
+    }
+
+    for ( i = 0; i < GRID_SIZE; i++ ) {
+        for ( j = 0; j < GRID_SIZE; j++ ) {
+            new_wm->grid[i][j] = wm_get_seen_tile(wm, pos_set(j, i));
+            new_wm->been[i][j] = false;
+        }
+    }
+
+    new_wm->dir = DIRECTION_UP;
+    new_wm->pos = pos_set(HOME_POS, HOME_POS);
+    new_wm->been[HOME_POS][HOME_POS] = true;
+
+    new_wm->treasure = false;
+    new_wm->key      = false;
+    new_wm->axe      = false;
+    new_wm->raft     = false;
+    new_wm->stones   = 0;
+
+    return new_wm;
+}
+
+// Finds a winning plan with the fewest actions, treating the tiles the
+// world model knows as the whole map. Returns the number of actions, or
+// -1 if there's no way to win or the search saw more than max_states
+// states without finding one. A max_states of 0 means no limit.
+int wm_solve(struct WorldModel* wm, char* actions, int n_threads, long max_states, long* states) {
+    struct SolveSearch search;
+    struct SolveWorker* workers;
+    struct SolveFrontier* buckets = NULL;
+    int n_buckets = 0;
+    long pending = 0;
+    unsigned long long key[SOLVE_MAX_WORDS];
+    unsigned long long id;
+    int length = -1;
+    int i, j;
+
+    *states = 0;
+    memset(&search, 0, sizeof(search));
+    search.start = wm;
+    search.layout = solve_layout_create(wm);
+    if ( search.layout == NULL ) {
+        return -1;
+    }
+    int words = search.layout->words;
+
+    if ( n_threads < 1 ) {
+        n_threads = 1;
+    }
+    workers = calloc(n_threads, sizeof(struct SolveWorker));
+    if ( workers == NULL || !solve_dist_create(&search) ) {
+        fprintf(stderr, "No memory for wm_solve!\n");
+        free(workers);
+        free(search.home_dist);
+        free(search.win_dist);
+        solve_layout_destroy(search.layout);
+        return -1;
+    }
+
+    pthread_mutex_init(&search.goal_lock, NULL);
+    for ( i = 0; i < SOLVE_SHARDS; i++ ) {
+        struct SolveShard* shard = &search.shards[i];
+        pthread_mutex_init(&shard->lock, NULL);
+        shard->cap        = 256;
+        shard->table_size = 1024;
+        shard->keys   = malloc(sizeof(unsigned long long) * shard->cap * words);
+        shard->parent = malloc(sizeof(unsigned long long) * shard->cap);
+        shard->g      = malloc(sizeof(int) * shard->cap);
+        shard->action = malloc(shard->cap);
+        shard->table  = calloc(shard->table_size, sizeof(unsigned int));
+        if ( shard->keys == NULL || shard->parent == NULL || shard->g == NULL ||
+                shard->action == NULL || shard->table == NULL ) {
+            search.failed = true;
+        }
+    }
+    for ( i = 0; i < n_threads; i++ ) {
+        workers[i].search = &search;
+        workers[i].wm = wm_copy(wm);
+        if ( workers[i].wm == NULL ) {
+            search.failed = true;
+        }
+    }
+
+    // The starting state, with every slot free
+    memset(key, 0, sizeof(key));
+    solve_put(key, 0, search.layout->pos_bits, solve_pos_index(search.layout, wm->pos));
+    solve_put(key, search.layout->dir_off, 2, wm->dir);
+    solve_put(key, search.layout->raft_off, 1, wm->raft);
+    for ( i = 0; i < search.layout->n_slots; i++ ) {
+        solve_put(key, search.layout->slot_off + i * search.layout->slot_bits,
+                  search.layout->slot_bits, (1ULL << search.layout->slot_bits) - 1);
+    }
+    search.f = solve_heuristic(&search, wm);
+    if ( search.f != SOLVE_FAR && !search.failed ) {
+        if ( !solve_insert(&search, key, 0, SOLVE_NO_PARENT, 0, &id) ||
+                !solve_frontier_push(&search.frontier, id, 0, key, words) ) {
+            search.failed = true;
+        }
+        pending = 1;
+    }
+
+    // Expand the lowest bucket until it's empty, then move up to the next
+    while ( pending > 0 && !search.found && !search.failed ) {
+        if ( search.frontier.size == 0 ) {
+            search.f++;
+            if ( search.f < n_buckets ) {
+                struct SolveFrontier empty = search.frontier;
+                search.frontier = buckets[search.f];
+                buckets[search.f] = empty;
+            }
+            continue;
+        }
+        pending -= search.frontier.size;
+
+        search.next_chunk = 0;
+        for ( i = 0; i < n_threads; i++ ) {
+            for ( j = 0; j < SOLVE_SPREAD; j++ ) {
+                workers[i].next[j].size = 0;
+            }
+            pthread_create(&workers[i].thread, NULL, solve_worker, &workers[i]);
+        }
+        for ( i = 0; i < n_threads; i++ ) {
+            pthread_join(workers[i].thread, NULL);
+        }
+
+        if ( n_buckets < search.f + SOLVE_SPREAD ) {
+            int size = 2 * (search.f + SOLVE_SPREAD);
+            struct SolveFrontier* grown = realloc(buckets, sizeof(struct SolveFrontier) * size);
+            if ( grown == NULL ) {
+                fprintf(stderr, "No memory for wm_solve!\n");
+                search.failed = true;
+                break;
+            }
+            buckets = grown;
+            memset(&buckets[n_buckets], 0, sizeof(struct SolveFrontier) * (size - n_buckets));
+            n_buckets = size;
+        }
+
+        // The workers are done with this round, so bucket f starts again
+        // with what they added to it
+        search.frontier.size = 0;
+        for ( i = 0; i < n_threads && !search.failed; i++ ) {
+            for ( j = 0; j < SOLVE_SPREAD; j++ ) {
+                struct SolveFrontier* next = &workers[i].next[j];
+                struct SolveFrontier* bucket = j == 0 ? &search.frontier : &buckets[search.f + j];
+                long k;
+                for ( k = 0; k < next->size; k++ ) {
+                    if ( !solve_frontier_push(bucket, next->ids[k], next->g[k], &next->keys[k * words], words) ) {
+                        fprintf(stderr, "No memory for wm_solve!\n");
+                        search.failed = true;
+                        break;
+                    }
+                }
+                pending += next->size;
+            }
+        }
+
+        // Give up once the search grows too big for the caller
+        if ( max_states > 0 && !search.found ) {
+            long seen = 0;
+            for ( i = 0; i < SOLVE_SHARDS; i++ ) {
+                seen += search.shards[i].size;
+            }
+            if ( seen > max_states ) {
+                break;
+            }
+        }
+    }
+
+    if ( search.found && !search.failed ) {
+        // Follow the parents back to the start, then reverse
+        length = 0;
+        for ( id = search.goal; id != SOLVE_NO_PARENT && length < MAX_PATH_LEN - 1; ) {
+            struct SolveShard* shard = &search.shards[id % SOLVE_SHARDS];
+            unsigned long long parent = shard->parent[id / SOLVE_SHARDS];
+            if ( parent != SOLVE_NO_PARENT ) {
+                actions[length++] = shard->action[id / SOLVE_SHARDS];
+            }
+            id = parent;
+        }
+        if ( id != SOLVE_NO_PARENT ) {
+            fprintf(stderr, "Plan too long for wm_solve!\n");
+            length = -1;
+        } else {
+            for ( i = 0; i < length / 2; i++ ) {
+                char action = actions[i];
+                actions[i] = actions[length - 1 - i];
+                actions[length - 1 - i] = action;
+            }
+            actions[length] = '\0';
+        }
+    }
+
+    for ( i = 0; i < SOLVE_SHARDS; i++ ) {
+        struct SolveShard* shard = &search.shards[i];
+        *states += shard->size;
+        pthread_mutex_destroy(&shard->lock);
+        free(shard->keys);
+        free(shard->parent);
+        free(shard->g);
+        free(shard->action);
+        free(shard->table);
+    }
+    for ( i = 0; i < n_threads; i++ ) {
+        wm_destroy(workers[i].wm);
+        for ( j = 0; j < SOLVE_SPREAD; j++ ) {
+            solve_frontier_free(&workers[i].next[j]);
+        }
+    }
+    for ( i = 0; i < n_buckets; i++ ) {
+        solve_frontier_free(&buckets[i]);
+    }
+    free(buckets);
+    free(workers);
+    solve_frontier_free(&search.frontier);
+    free(search.home_dist);
+    free(search.win_dist);
+    pthread_mutex_destroy(&search.goal_lock);
+    solve_layout_destroy(search.layout);
+
+    return length;
+}
@@ -2,6 +2,7 @@
 #define WORLDMODEL_H
 
 #include <stdbool.h>
+#include <stdio.h>
 
 // We define home as the center of the grid
 #define HOME_POS 80
@@ -42,7 +43,10 @@ typedef int Direction;
 Direction dir_turn_right( Direction dir );
 Direction dir_turn_left( Direction dir );
 
-struct Pos;
+struct Pos {
+    int x;
+    int y;
+};
 
 struct Pos pos_set( int x, int y );
 bool pos_equal( struct Pos p, struct Pos q );
@@ -53,15 +57,26 @@ struct WorldModel;
 
 struct WorldModel* wm_create(char view[VIEW_SIZE][VIEW_SIZE]);
 void wm_destroy(struct WorldModel* wm);
+struct WorldModel* wm_copy(struct WorldModel* wm);
 
 void wm_take_action(struct WorldModel* wm, char action);
-void wm_update_view(struct WorldModel* wm, char view[VIEW_SIZE][VIEW_SIZE]);
+int wm_update_view(struct WorldModel* wm, char view[VIEW_SIZE][VIEW_SIZE]);
 
 char wm_get_tile(struct WorldModel* wm, struct Pos pos);
 void wm_set_tile(struct WorldModel* wm, struct Pos pos, char tile_val);
+char wm_get_seen_tile(struct WorldModel* wm, struct Pos pos);
+// Fill in tiles we haven't seen with what we expect them to be, from the
+// width by height block of tiles at left, top, skipping unknown ones.
+// They count as known until the view shows them or we forget them, and
+// stay unknown to wm_get_seen_tile until we see them. Only the world
+// model made by wm_create takes them.
+void wm_assume_tiles(struct WorldModel* wm, int left, int top, int width, int height, char* tiles);
+void wm_forget_assumed(struct WorldModel* wm);
 void wm_set_been(struct WorldModel* wm, struct Pos pos);
 bool wm_get_been(struct WorldModel* wm, struct Pos pos); 
 
+int wm_count_unknown(struct WorldModel* wm, struct Pos pos, int dist);
+
 void wm_print(struct WorldModel* wm);
 
 
@@ -75,10 +90,90 @@ enum Goal{ GOAL_EXPLORE,
 typedef int Goal;
 
 
-bool wm_dfs(struct WorldModel* old_wm, struct Pos cur_pos, Goal goal, int new_req,
-         bool seen[GRID_SIZE][GRID_SIZE], int depth_limit, char* actions);
+// Multi-goal planning
+// A single search that looks for several goals at once. Plans are given
+// in priority order, and the search stops as soon as nothing of higher
+// priority than the best goal found so far is left to look for.
+#define MAX_DEPTH    49
+#define MAX_PLANS    16
+// Every step takes at most 4 actions
+#define MAX_PLAN_LEN (4*MAX_DEPTH + 1)
+// Once a winning plan holds the treasure it may head straight home, and
+// that trip doesn't count against the depth. A trip home of more than
+// MAX_HOME_STEPS steps is left to the search.
+#define MAX_HOME_STEPS 1024
+#define MAX_HOME_LEN   (4*MAX_HOME_STEPS + 1)
+// Whole paths, up to one that visits every tile on the grid once
+#define MAX_PATH_LEN (4*(GRID_SIZE)*(GRID_SIZE) + 1)
+
+typedef unsigned short GoalMask;
+
+struct Plan {
+    Goal goal;
+    int new_req;
+
+    // Filled in by wm_plan. A winning plan that heads straight home once
+    // it holds the treasure has the trip home in home_actions.
+    bool found;
+    char actions[MAX_PLAN_LEN];
+    char home_actions[MAX_HOME_LEN];
+};
+
+int wm_plan(struct WorldModel* wm, struct Plan* plans, int n_plans);
+// Write out the whole of a plan that was found, trip home and all
+void wm_plan_path(struct Plan* plan, char* actions);
+
 bool wm_walk(struct WorldModel* wm, char* actions, Goal goal, int new_req);
 bool wm_walk_test_permissible(struct WorldModel* wm, struct Pos pos, Goal goal);
 bool wm_walk_test_goal(struct WorldModel* wm, Goal goal, char old_tile, int new_req);
 
+// Plan a win as a tour of the points of interest (home, items, trees and
+// doors), using paths between them cached in the world model, over land,
+// on stones or across the water by raft. actions holds MAX_PATH_LEN.
+bool wm_poi_win(struct WorldModel* wm, char* actions);
+
+bool wm_explore(struct WorldModel* wm, char* actions);
+bool wm_explore_test_plan(struct WorldModel* wm, char* actions);
+
+// Reachability
+// The tiles we can walk to from where we stand, one bit per tile, with
+// each row of the grid packed into REACH_WORDS words. The rules say which
+// kinds of tile the walk may cross. With REACH_ITEMS the walk picks up
+// the items it comes to and from then on crosses whatever they let it,
+// as if they lasted for good.
+#define REACH_LAND   1    // land, home, used stones and items
+#define REACH_WATER  2
+#define REACH_TREES  4
+#define REACH_DOORS  8
+#define REACH_STONES 16
+#define REACH_ITEMS  32
+#define REACH_WORDS  (((GRID_SIZE) + 63) / 64)
+
+struct Reach {
+    unsigned long long rows[GRID_SIZE][REACH_WORDS];
+};
+
+void wm_reach(struct WorldModel* wm, int rules, struct Reach* reach);
+bool reach_test(struct Reach* reach, struct Pos pos);
+
+// What the tiles we can walk to leave room for, so the planner can skip
+// goals there's no way to meet. Each answer errs on the side of yes:
+// items count as held for good once we can walk to them.
+struct ReachGoals {
+    bool win;          // the treasure is within reach, or already held
+    bool explore;      // exploring can get somewhere that shows unknown tiles
+    int new_tiles;     // tiles within reach we haven't been on
+};
+
+void wm_reach_goals(struct WorldModel* wm, struct ReachGoals* goals);
+
+// Full knowledge solver
+// Finds the shortest winning plan on a map known in full, as a yardstick
+// for the agent's plans. Searches with n_threads threads and returns the
+// number of actions, or -1 if there's no way to win within max_states
+// states (0 for no limit).
+struct WorldModel* wm_load_map(FILE* in);
+struct WorldModel* wm_seen_copy(struct WorldModel* wm);
+int wm_solve(struct WorldModel* wm, char* actions, int n_threads, long max_states, long* states);
+
 #endif